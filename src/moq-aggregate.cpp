@@ -0,0 +1,242 @@
+#include "moq-aggregate.h"
+
+namespace {
+
+// Duration of one frame for an Opus TOC configuration number (RFC 6716 section 3.1).
+uint64_t opus_frame_duration_us(uint8_t config)
+{
+	if (config < 12) {
+		// SILK: 10, 20, 40, 60 ms
+		static const uint64_t silk[] = {10000, 20000, 40000, 60000};
+		return silk[config % 4];
+	}
+	if (config < 16) {
+		// Hybrid: 10, 20 ms
+		return config % 2 ? 20000 : 10000;
+	}
+	// CELT: 2.5, 5, 10, 20 ms
+	static const uint64_t celt[] = {2500, 5000, 10000, 20000};
+	return celt[config % 4];
+}
+
+bool read_frame_length(const uint8_t *&p, const uint8_t *end, size_t &length)
+{
+	if (p >= end) {
+		return false;
+	}
+	if (*p < 252) {
+		length = *p++;
+		return true;
+	}
+	if (end - p < 2) {
+		return false;
+	}
+	length = p[0] + 4 * (size_t)p[1];
+	p += 2;
+	return true;
+}
+
+void write_frame_length(std::vector<uint8_t> &out, size_t length)
+{
+	if (length < 252) {
+		out.push_back((uint8_t)length);
+	} else {
+		uint8_t first = (uint8_t)(252 + (length & 3));
+		out.push_back(first);
+		out.push_back((uint8_t)((length - first) / 4));
+	}
+}
+
+// Splits an Opus packet into its frames.
+bool parse_opus_packet(const uint8_t *data, size_t size, std::vector<std::pair<const uint8_t *, size_t>> &frames)
+{
+	frames.clear();
+	if (size < 1) {
+		return false;
+	}
+
+	const uint8_t *p = data + 1;
+	const uint8_t *end = data + size;
+
+	switch (data[0] & 3) {
+	case 0:
+		frames.emplace_back(p, (size_t)(end - p));
+		return true;
+	case 1: {
+		size_t length = (size_t)(end - p);
+		if (length % 2) {
+			return false;
+		}
+		frames.emplace_back(p, length / 2);
+		frames.emplace_back(p + length / 2, length / 2);
+		return true;
+	}
+	case 2: {
+		size_t first;
+		if (!read_frame_length(p, end, first) || first > (size_t)(end - p)) {
+			return false;
+		}
+		frames.emplace_back(p, first);
+		frames.emplace_back(p + first, (size_t)(end - p) - first);
+		return true;
+	}
+	default:
+		break;
+	}
+
+	if (p >= end) {
+		return false;
+	}
+
+	uint8_t header = *p++;
+	bool vbr = header & 0x80;
+	bool padded = header & 0x40;
+	size_t count = header & 0x3f;
+	if (count == 0) {
+		return false;
+	}
+
+	size_t padding = 0;
+	if (padded) {
+		uint8_t byte;
+		do {
+			if (p >= end) {
+				return false;
+			}
+			byte = *p++;
+			padding += byte == 255 ? 254 : byte;
+		} while (byte == 255);
+	}
+
+	if (padding > (size_t)(end - p)) {
+		return false;
+	}
+	end -= padding;
+
+	std::vector<size_t> lengths;
+	if (vbr) {
+		for (size_t i = 0; i + 1 < count; i++) {
+			size_t length;
+			if (!read_frame_length(p, end, length)) {
+				return false;
+			}
+			lengths.push_back(length);
+		}
+	}
+
+	size_t remaining = (size_t)(end - p);
+	if (vbr) {
+		size_t used = 0;
+		for (size_t length : lengths) {
+			used += length;
+		}
+		if (used > remaining) {
+			return false;
+		}
+		lengths.push_back(remaining - used);
+	} else {
+		if (remaining % count) {
+			return false;
+		}
+		lengths.assign(count, remaining / count);
+	}
+
+	for (size_t length : lengths) {
+		frames.emplace_back(p, length);
+		p += length;
+	}
+
+	return true;
+}
+
+} // namespace
+
+void MoQAudioAggregator::Configure(size_t frames_per_object, uint64_t max_latency_us)
+{
+	this->frames_per_object = frames_per_object < MAX_FRAMES ? frames_per_object : MAX_FRAMES;
+	this->max_latency_us = max_latency_us;
+	Reset();
+}
+
+void MoQAudioAggregator::Reset()
+{
+	toc = 0;
+	data.clear();
+	lengths.clear();
+	pts_us = 0;
+	sys_dts_usec = 0;
+	duration_us = 0;
+}
+
+void MoQAudioAggregator::Flush(std::vector<MoQAudioObject> &out)
+{
+	if (lengths.empty()) {
+		return;
+	}
+
+	MoQAudioObject object;
+	object.pts_us = pts_us;
+	object.sys_dts_usec = sys_dts_usec;
+	object.frames = lengths.size();
+
+	if (lengths.size() == 1) {
+		// A single frame goes out as a plain code 0 packet.
+		object.payload.reserve(1 + data.size());
+		object.payload.push_back((uint8_t)(toc & 0xfc));
+		object.payload.insert(object.payload.end(), data.begin(), data.end());
+	} else {
+		// Code 3, VBR, no padding: every frame length but the last is coded explicitly.
+		object.payload.reserve(2 + 2 * lengths.size() + data.size());
+		object.payload.push_back((uint8_t)((toc & 0xfc) | 3));
+		object.payload.push_back((uint8_t)(0x80 | lengths.size()));
+		for (size_t i = 0; i + 1 < lengths.size(); i++) {
+			write_frame_length(object.payload, lengths[i]);
+		}
+		object.payload.insert(object.payload.end(), data.begin(), data.end());
+	}
+
+	out.push_back(std::move(object));
+	Reset();
+}
+
+bool MoQAudioAggregator::Push(const uint8_t *packet, size_t size, uint64_t packet_pts_us, int64_t packet_sys_dts_usec,
+			      std::vector<MoQAudioObject> &out)
+{
+	std::vector<std::pair<const uint8_t *, size_t>> packet_frames;
+	if (!parse_opus_packet(packet, size, packet_frames)) {
+		return false;
+	}
+
+	uint64_t frame_us = opus_frame_duration_us(packet[0] >> 3);
+	uint64_t packet_us = frame_us * packet_frames.size();
+
+	// Frames can only share a packet if the mode, bandwidth, frame size and channel count match.
+	bool compatible = (packet[0] & 0xfc) == (toc & 0xfc);
+	bool fits = lengths.size() + packet_frames.size() <= MAX_FRAMES && duration_us + packet_us <= MAX_DURATION_US;
+
+	if (!lengths.empty() && (!compatible || !fits)) {
+		Flush(out);
+	}
+
+	if (lengths.empty()) {
+		toc = packet[0];
+		pts_us = packet_pts_us;
+		sys_dts_usec = packet_sys_dts_usec;
+	}
+
+	for (const auto &frame : packet_frames) {
+		data.insert(data.end(), frame.first, frame.first + frame.second);
+		lengths.push_back(frame.second);
+	}
+	duration_us += packet_us;
+
+	// Emit once enough frames are buffered, or once the first one has waited as long as allowed for
+	// the next frame to arrive.
+	bool full = lengths.size() >= frames_per_object;
+	bool late = max_latency_us > 0 && duration_us + frame_us > max_latency_us;
+	if (full || late) {
+		Flush(out);
+	}
+
+	return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// An audio object ready to publish, made of one or more encoder frames.
+struct MoQAudioObject {
+    std::vector<uint8_t> payload;
+    // Timestamp of the first frame; the others follow at the fixed frame duration.
+    uint64_t pts_us = 0;
+    int64_t sys_dts_usec = 0;
+    size_t frames = 0;
+};
+
+// Merges consecutive Opus packets into a single multi-frame Opus packet (RFC 6716 section 3.2.5,
+// code 3), so several frames go out as one MoQ object while staying decodable by any Opus decoder.
+// Each frame keeps its own timestamp implicitly: frame k plays at pts + k * frame duration.
+class MoQAudioAggregator
+{
+      public:
+    // Opus allows at most 48 frames and 120 ms per packet.
+    static constexpr size_t MAX_FRAMES = 48;
+    static constexpr uint64_t MAX_DURATION_US = 120000;
+
+    MoQAudioAggregator()
+        : frames_per_object(1),
+          max_latency_us(0),
+          toc(0),
+          pts_us(0),
+          sys_dts_usec(0),
+          duration_us(0)
+    {
+    }
+
+    // frames_per_object <= 1 disables aggregation. max_latency_us bounds how long the first frame of an
+    // object may wait for the rest.
+    void Configure(size_t frames_per_object, uint64_t max_latency_us);
+
+    bool Enabled() const
+    {
+        return frames_per_object > 1;
+    }
+
+    // Adds one Opus packet. Completed objects are appended to out; there may be two if the packet
+    // couldn't be merged with the pending ones. Returns false if the packet isn't valid Opus.
+    bool Push(const uint8_t *data, size_t size, uint64_t pts_us, int64_t sys_dts_usec,
+              std::vector<MoQAudioObject> &out);
+
+    // Emits whatever is pending, e.g. when the output stops.
+    void Flush(std::vector<MoQAudioObject> &out);
+
+    void Reset();
+
+      private:
+    size_t frames_per_object;
+    uint64_t max_latency_us;
+
+    // Pending frames, all sharing the same TOC configuration (mode, bandwidth, frame size, channels).
+    // The frame data is copied, since the encoder packets are released once they've been pushed.
+    uint8_t toc;
+    std::vector<uint8_t> data;
+    std::vector<size_t> lengths;
+    uint64_t pts_us;
+    int64_t sys_dts_usec;
+    uint64_t duration_us;
+};
@@ -0,0 +1,182 @@
+#include "moq-annexb.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MOQ_ANNEXB_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+namespace {
+
+#ifdef MOQ_ANNEXB_X86
+
+inline int lowest_bit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Compares 16 positions at once: a start code begins at i if bytes i and i + 1 are zero and byte i + 2
+// is one.
+const uint8_t *find_start_code_sse2(const uint8_t *p, const uint8_t *end)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+
+	while (end - p >= 18) {
+		__m128i b0 = _mm_loadu_si128((const __m128i *)p);
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+		__m128i b2 = _mm_loadu_si128((const __m128i *)(p + 2));
+		__m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+					    _mm_cmpeq_epi8(b2, one));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+		if (mask) {
+			return p + lowest_bit(mask);
+		}
+		p += 16;
+	}
+
+	return annexb_find_start_code_scalar(p, end);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MOQ_ANNEXB_AVX2 __attribute__((target("avx2")))
+#elif defined(__AVX2__)
+#define MOQ_ANNEXB_AVX2
+#endif
+
+#ifdef MOQ_ANNEXB_AVX2
+
+MOQ_ANNEXB_AVX2 const uint8_t *find_start_code_avx2(const uint8_t *p, const uint8_t *end)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+
+	while (end - p >= 34) {
+		__m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+		__m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+		__m256i b2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+		__m256i hit = _mm256_and_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+			_mm256_cmpeq_epi8(b2, one));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+		if (mask) {
+			return p + lowest_bit(mask);
+		}
+		p += 32;
+	}
+
+	return find_start_code_sse2(p, end);
+}
+
+bool cpu_has_avx2()
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_cpu_supports("avx2");
+#else
+	return true;
+#endif
+}
+
+#endif // MOQ_ANNEXB_AVX2
+#endif // MOQ_ANNEXB_X86
+
+using find_start_code_fn = const uint8_t *(*)(const uint8_t *, const uint8_t *);
+
+find_start_code_fn select_find_start_code()
+{
+#if defined(MOQ_ANNEXB_AVX2)
+	if (cpu_has_avx2()) {
+		return find_start_code_avx2;
+	}
+#endif
+#if defined(MOQ_ANNEXB_X86)
+	return find_start_code_sse2;
+#else
+	return annexb_find_start_code_scalar;
+#endif
+}
+
+const find_start_code_fn find_start_code = select_find_start_code();
+
+bool is_parameter_set(uint8_t header, bool hevc)
+{
+	if (hevc) {
+		// VPS, SPS, PPS, access unit delimiter
+		uint8_t type = (header >> 1) & 0x3f;
+		return type >= 32 && type <= 35;
+	}
+
+	// SPS, PPS, access unit delimiter
+	uint8_t type = header & 0x1f;
+	return type == 7 || type == 8 || type == 9;
+}
+
+} // namespace
+
+const uint8_t *annexb_find_start_code_scalar(const uint8_t *data, const uint8_t *end)
+{
+	// Let memchr (vectorized in most C libraries) find the 01, then check the two bytes before it.
+	const uint8_t *p = data + 2;
+	while (p < end) {
+		p = (const uint8_t *)memchr(p, 1, (size_t)(end - p));
+		if (!p) {
+			return end;
+		}
+		if (p[-1] == 0 && p[-2] == 0) {
+			return p - 2;
+		}
+		p++;
+	}
+
+	return end;
+}
+
+const uint8_t *annexb_find_start_code(const uint8_t *data, const uint8_t *end)
+{
+	return find_start_code(data, end);
+}
+
+bool annexb_to_length_prefixed(const uint8_t *data, size_t size, bool hevc, std::vector<uint8_t> &out)
+{
+	const uint8_t *end = data + size;
+	const uint8_t *start = annexb_find_start_code(data, end);
+	if (start == end) {
+		return false;
+	}
+
+	out.reserve(out.size() + size);
+
+	while (start < end) {
+		const uint8_t *nal = start + 3;
+		const uint8_t *next = annexb_find_start_code(nal, end);
+
+		// Trailing zero bytes belong to the next four byte start code (or are padding).
+		const uint8_t *nal_end = next;
+		while (nal_end > nal && nal_end[-1] == 0) {
+			nal_end--;
+		}
+
+		size_t length = (size_t)(nal_end - nal);
+		if (length > 0 && !is_parameter_set(nal[0], hevc)) {
+			out.push_back((uint8_t)(length >> 24));
+			out.push_back((uint8_t)(length >> 16));
+			out.push_back((uint8_t)(length >> 8));
+			out.push_back((uint8_t)length);
+			out.insert(out.end(), nal, nal_end);
+		}
+
+		start = next;
+	}
+
+	return true;
+}
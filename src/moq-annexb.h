@@ -0,0 +1,17 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Returns the first 00 00 01 start code in [data, end), or end if there is none. A four byte start code
+// is found at its last three bytes. Uses AVX2 or SSE2 where the CPU has them.
+const uint8_t *annexb_find_start_code(const uint8_t *data, const uint8_t *end);
+
+// Portable version of annexb_find_start_code, used where no vector unit is available.
+const uint8_t *annexb_find_start_code_scalar(const uint8_t *data, const uint8_t *end);
+
+// Rewrites an Annex-B access unit as 4-byte length-prefixed NAL units (the avc1/hvc1 sample format),
+// appending to out. Parameter sets (H.264 SPS/PPS, HEVC VPS/SPS/PPS) and access unit delimiters are
+// dropped, since an avc1/hvc1 track carries its parameter sets in the configuration record.
+// Returns false if no start code was found.
+bool annexb_to_length_prefixed(const uint8_t *data, size_t size, bool hevc, std::vector<uint8_t> &out);
@@ -0,0 +1,268 @@
+#include "moq-capture-time.h"
+
+#include <algorithm>
+
+#include "moq-annexb.h"
+
+namespace {
+
+// Identifies the payload among other user data. Contains no zero bytes, so it is never altered by
+// emulation prevention.
+const uint8_t CAPTURE_TIME_UUID[16] = {0x4f, 0x42, 0x53, 0x2d, 0x4d, 0x6f, 0x51, 0x2d,
+				       0x63, 0x61, 0x70, 0x74, 0x75, 0x72, 0x65, 0x01};
+
+constexpr size_t PAYLOAD_SIZE = sizeof(CAPTURE_TIME_UUID) + 8;
+
+void append_payload(std::vector<uint8_t> &out, int64_t unix_us)
+{
+	out.insert(out.end(), CAPTURE_TIME_UUID, CAPTURE_TIME_UUID + sizeof(CAPTURE_TIME_UUID));
+	for (int shift = 56; shift >= 0; shift -= 8) {
+		out.push_back((uint8_t)((uint64_t)unix_us >> shift));
+	}
+}
+
+// SEI NAL unit (header included, no start code or length) carrying the capture time.
+std::vector<uint8_t> make_sei(bool hevc, int64_t unix_us)
+{
+	std::vector<uint8_t> rbsp;
+	rbsp.push_back(5); // user_data_unregistered
+	rbsp.push_back((uint8_t)PAYLOAD_SIZE);
+	append_payload(rbsp, unix_us);
+	rbsp.push_back(0x80); // rbsp_trailing_bits
+
+	std::vector<uint8_t> nal;
+	if (hevc) {
+		nal.push_back(39 << 1); // PREFIX_SEI_NUT
+		nal.push_back(1);       // nuh_temporal_id_plus1
+	} else {
+		nal.push_back(6); // SEI
+	}
+
+	// Emulation prevention: no 00 00 0x (x <= 3) may appear inside the NAL unit.
+	int zeros = 0;
+	for (uint8_t byte : rbsp) {
+		if (zeros >= 2 && byte <= 3) {
+			nal.push_back(3);
+			zeros = 0;
+		}
+		nal.push_back(byte);
+		zeros = byte == 0 ? zeros + 1 : 0;
+	}
+
+	return nal;
+}
+
+std::vector<uint8_t> make_metadata_obu(int64_t unix_us)
+{
+	std::vector<uint8_t> obu;
+	obu.push_back((5 << 3) | 0x02); // OBU_METADATA, obu_has_size_field
+	obu.push_back((uint8_t)(1 + PAYLOAD_SIZE + 1));
+	obu.push_back(6); // metadata_type: unregistered user private
+	append_payload(obu, unix_us);
+	obu.push_back(0x80); // trailing_bits
+	return obu;
+}
+
+bool is_vcl(uint8_t header, bool hevc)
+{
+	if (hevc) {
+		return ((header >> 1) & 0x3f) < 32;
+	}
+
+	uint8_t type = header & 0x1f;
+	return type >= 1 && type <= 5;
+}
+
+bool read_leb128(const uint8_t *&p, const uint8_t *end, uint64_t &value)
+{
+	value = 0;
+	for (int i = 0; i < 8; i++) {
+		if (p >= end) {
+			return false;
+		}
+		uint8_t byte = *p++;
+		value |= (uint64_t)(byte & 0x7f) << (i * 7);
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Offset of the first NAL unit (or OBU) carrying picture data, or size if there is none.
+size_t find_insert_offset(const uint8_t *data, size_t size, MoQBitstream format, bool hevc)
+{
+	const uint8_t *end = data + size;
+
+	switch (format) {
+	case MoQBitstream::AnnexB: {
+		const uint8_t *start = annexb_find_start_code(data, end);
+		while (start < end) {
+			const uint8_t *nal = start + 3;
+			if (nal < end && is_vcl(*nal, hevc)) {
+				// Step back over the leading zero of a four byte start code.
+				return (size_t)((start > data && start[-1] == 0 ? start - 1 : start) - data);
+			}
+			start = annexb_find_start_code(nal, end);
+		}
+		return size;
+	}
+	case MoQBitstream::LengthPrefixed: {
+		const uint8_t *p = data;
+		while (end - p > 4) {
+			size_t length = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+			if (is_vcl(p[4], hevc)) {
+				return (size_t)(p - data);
+			}
+			if (length > (size_t)(end - p) - 4) {
+				break;
+			}
+			p += 4 + length;
+		}
+		return size;
+	}
+	case MoQBitstream::AV1: {
+		const uint8_t *p = data;
+		while (p < end) {
+			const uint8_t *obu = p;
+			uint8_t header = *p++;
+			uint8_t type = (header >> 3) & 0x0f;
+			if (type == 3 || type == 4 || type == 6) {
+				// Frame header, tile group, frame
+				return (size_t)(obu - data);
+			}
+			if (header & 0x04) {
+				p++; // extension header
+			}
+			if (!(header & 0x02)) {
+				break; // no size field: this OBU runs to the end
+			}
+			uint64_t obu_size;
+			if (!read_leb128(p, end, obu_size) || obu_size > (uint64_t)(end - p)) {
+				break;
+			}
+			p += obu_size;
+		}
+		return size;
+	}
+	}
+
+	return size;
+}
+
+} // namespace
+
+bool capture_time_insert(const uint8_t *data, size_t size, MoQBitstream format, bool hevc, int64_t unix_us,
+			 std::vector<uint8_t> &out)
+{
+	size_t offset = find_insert_offset(data, size, format, hevc);
+	if (offset >= size) {
+		return false;
+	}
+
+	std::vector<uint8_t> unit = format == MoQBitstream::AV1 ? make_metadata_obu(unix_us) : make_sei(hevc, unix_us);
+
+	out.clear();
+	out.reserve(size + unit.size() + 4);
+	out.insert(out.end(), data, data + offset);
+
+	if (format == MoQBitstream::AnnexB) {
+		const uint8_t start_code[] = {0, 0, 0, 1};
+		out.insert(out.end(), start_code, start_code + 4);
+	} else if (format == MoQBitstream::LengthPrefixed) {
+		size_t length = unit.size();
+		out.push_back((uint8_t)(length >> 24));
+		out.push_back((uint8_t)(length >> 16));
+		out.push_back((uint8_t)(length >> 8));
+		out.push_back((uint8_t)length);
+	}
+
+	out.insert(out.end(), unit.begin(), unit.end());
+	out.insert(out.end(), data + offset, data + size);
+	return true;
+}
+
+bool capture_time_find(const uint8_t *data, size_t size, MoQBitstream format, bool hevc, int64_t &unix_us)
+{
+	// H.264/HEVC SEI payloads are escaped; AV1 metadata OBUs aren't.
+	bool escaped = format != MoQBitstream::AV1;
+	const uint8_t *end = data + find_insert_offset(data, size, format, hevc);
+	const uint8_t *p = std::search(data, end, CAPTURE_TIME_UUID, CAPTURE_TIME_UUID + sizeof(CAPTURE_TIME_UUID));
+	if (p == end) {
+		return false;
+	}
+	p += sizeof(CAPTURE_TIME_UUID);
+
+	uint64_t value = 0;
+	int read = 0;
+	int zeros = 0;
+	while (read < 8 && p < end) {
+		uint8_t byte = *p++;
+		if (escaped && zeros >= 2 && byte == 3) {
+			zeros = 0;
+			continue;
+		}
+		value = (value << 8) | byte;
+		zeros = byte == 0 ? zeros + 1 : 0;
+		read++;
+	}
+
+	if (read < 8) {
+		return false;
+	}
+
+	unix_us = (int64_t)value;
+	return true;
+}
+
+constexpr std::array<uint32_t, 11> MoQLatencyHistogram::BOUNDS_MS;
+
+void MoQLatencyHistogram::Reset()
+{
+	for (auto &bucket : buckets) {
+		bucket = 0;
+	}
+	count = 0;
+	sum_us = 0;
+	min_us = INT64_MAX;
+	max_us = INT64_MIN;
+	last_us = 0;
+}
+
+void MoQLatencyHistogram::Add(int64_t latency_us)
+{
+	size_t i = 0;
+	while (i < BOUNDS_MS.size() && latency_us > (int64_t)BOUNDS_MS[i] * 1000) {
+		i++;
+	}
+
+	buckets[i].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum_us.fetch_add((uint64_t)std::max<int64_t>(latency_us, 0), std::memory_order_relaxed);
+	last_us.store(latency_us, std::memory_order_relaxed);
+	if (latency_us < min_us.load(std::memory_order_relaxed)) {
+		min_us.store(latency_us, std::memory_order_relaxed);
+	}
+	if (latency_us > max_us.load(std::memory_order_relaxed)) {
+		max_us.store(latency_us, std::memory_order_relaxed);
+	}
+}
+
+int64_t MoQLatencyHistogram::PercentileMs(double percentile) const
+{
+	uint64_t total = count.load(std::memory_order_relaxed);
+	if (total == 0) {
+		return -1;
+	}
+
+	uint64_t target = (uint64_t)(total * percentile / 100.0);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < buckets.size(); i++) {
+		seen += buckets[i].load(std::memory_order_relaxed);
+		if (seen > target || seen == total) {
+			return i < BOUNDS_MS.size() ? BOUNDS_MS[i] : max_us.load(std::memory_order_relaxed) / 1000;
+		}
+	}
+
+	return max_us.load(std::memory_order_relaxed) / 1000;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Capture timestamps carried inside the video bitstream, so a subscriber can measure glass-to-glass
+// latency against its own clock. The payload is a 16-byte UUID followed by the capture time as a
+// big-endian Unix time in microseconds, wrapped as:
+//   H.264: SEI user_data_unregistered (NAL type 6)
+//   HEVC:  prefix SEI user_data_unregistered (NAL type 39)
+//   AV1:   metadata OBU, unregistered user private type 6
+// Decoders that don't know the UUID skip it.
+enum class MoQBitstream { AnnexB, LengthPrefixed, AV1 };
+
+// Copies an access unit into out with the capture time inserted ahead of the first coded picture
+// data (VCL NAL unit or frame/tile OBU). Returns false if there was nowhere to put it.
+bool capture_time_insert(const uint8_t *data, size_t size, MoQBitstream format, bool hevc, int64_t unix_us,
+                         std::vector<uint8_t> &out);
+
+// Searches an access unit for a capture time written by capture_time_insert. Only the units ahead of
+// the first coded picture data are searched, which is where capture_time_insert puts it.
+bool capture_time_find(const uint8_t *data, size_t size, MoQBitstream format, bool hevc, int64_t &unix_us);
+
+// Latency distribution for the MoQ source. Updated by the decode thread, readable from any thread.
+struct MoQLatencyHistogram {
+    // Upper bounds of the buckets, in milliseconds; the last bucket takes everything above.
+    static constexpr std::array<uint32_t, 11> BOUNDS_MS = {10, 20, 50, 100, 150, 200, 300, 500, 1000, 2000, 5000};
+
+    std::array<std::atomic<uint64_t>, BOUNDS_MS.size() + 1> buckets;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_us;
+    std::atomic<int64_t> min_us;
+    std::atomic<int64_t> max_us;
+    std::atomic<int64_t> last_us;
+
+    void Reset();
+    void Add(int64_t latency_us);
+    // Upper bound of the bucket holding the given percentile (0-100), in milliseconds; -1 if empty.
+    int64_t PercentileMs(double percentile) const;
+};
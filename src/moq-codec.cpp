@@ -0,0 +1,446 @@
+#include "moq-codec.h"
+
+#include <cstdio>
+
+namespace {
+
+// MSB-first bit reader. Reads past the end return zeros and set the overrun flag.
+class BitReader
+{
+public:
+	BitReader(const uint8_t *data, size_t size) : data(data), size(size), pos(0), overrun(false) {}
+
+	uint32_t Read(int bits)
+	{
+		uint32_t value = 0;
+		for (int i = 0; i < bits; i++) {
+			value <<= 1;
+			if (pos < size * 8) {
+				value |= (data[pos / 8] >> (7 - pos % 8)) & 1;
+			} else {
+				overrun = true;
+			}
+			pos++;
+		}
+		return value;
+	}
+
+	// AV1 uvlc(): unsigned exp-Golomb style code.
+	uint32_t ReadUvlc()
+	{
+		int leading_zeros = 0;
+		while (!Read(1)) {
+			if (overrun || ++leading_zeros >= 32) {
+				return UINT32_MAX;
+			}
+		}
+		return Read(leading_zeros) + ((1u << leading_zeros) - 1);
+	}
+
+	bool Overrun() const
+	{
+		return overrun;
+	}
+
+private:
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+	bool overrun;
+};
+
+bool read_leb128(const uint8_t *&p, const uint8_t *end, uint64_t &value)
+{
+	value = 0;
+	for (int i = 0; i < 8; i++) {
+		if (p >= end) {
+			return false;
+		}
+		uint8_t byte = *p++;
+		value |= (uint64_t)(byte & 0x7f) << (i * 7);
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void write_leb128(std::vector<uint8_t> &out, uint64_t value)
+{
+	do {
+		uint8_t byte = value & 0x7f;
+		value >>= 7;
+		if (value) {
+			byte |= 0x80;
+		}
+		out.push_back(byte);
+	} while (value);
+}
+
+const uint8_t OBU_SEQUENCE_HEADER = 1;
+
+} // namespace
+
+bool parse_av1_config(const uint8_t *data, size_t size, MoQCodecConfig &config)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = data + size;
+
+	// Walk the OBUs looking for the sequence header.
+	const uint8_t *payload = nullptr;
+	uint64_t payload_size = 0;
+
+	while (p < end) {
+		uint8_t header = *p++;
+		uint8_t type = (header >> 3) & 0x0f;
+		bool has_extension = header & 0x04;
+		bool has_size = header & 0x02;
+
+		if (has_extension) {
+			if (p >= end) {
+				return false;
+			}
+			p++;
+		}
+
+		uint64_t obu_size = (uint64_t)(end - p);
+		if (has_size && !read_leb128(p, end, obu_size)) {
+			return false;
+		}
+		if (obu_size > (uint64_t)(end - p)) {
+			return false;
+		}
+
+		if (type == OBU_SEQUENCE_HEADER) {
+			payload = p;
+			payload_size = obu_size;
+			break;
+		}
+
+		p += obu_size;
+	}
+
+	if (!payload) {
+		return false;
+	}
+
+	BitReader br(payload, payload_size);
+
+	uint32_t seq_profile = br.Read(3);
+	br.Read(1); // still_picture
+	bool reduced_still_picture_header = br.Read(1);
+
+	uint32_t seq_level_idx = 0;
+	uint32_t seq_tier = 0;
+
+	if (reduced_still_picture_header) {
+		seq_level_idx = br.Read(5);
+	} else {
+		bool decoder_model_info_present = false;
+		uint32_t buffer_delay_length = 0;
+
+		if (br.Read(1)) { // timing_info_present_flag
+			br.Read(32);  // num_units_in_display_tick
+			br.Read(32);  // time_scale
+			if (br.Read(1)) { // equal_picture_interval
+				br.ReadUvlc();
+			}
+
+			decoder_model_info_present = br.Read(1);
+			if (decoder_model_info_present) {
+				buffer_delay_length = br.Read(5) + 1;
+				br.Read(32); // num_units_in_decoding_tick
+				br.Read(5);  // buffer_removal_time_length_minus_1
+				br.Read(5);  // frame_presentation_time_length_minus_1
+			}
+		}
+
+		bool initial_display_delay_present = br.Read(1);
+		uint32_t operating_points = br.Read(5) + 1;
+
+		for (uint32_t i = 0; i < operating_points; i++) {
+			br.Read(12); // operating_point_idc
+			uint32_t level = br.Read(5);
+			uint32_t tier = level > 7 ? br.Read(1) : 0;
+
+			// The record describes operating point 0.
+			if (i == 0) {
+				seq_level_idx = level;
+				seq_tier = tier;
+			}
+
+			if (decoder_model_info_present && br.Read(1)) {
+				br.Read(buffer_delay_length); // decoder_buffer_delay
+				br.Read(buffer_delay_length); // encoder_buffer_delay
+				br.Read(1);                   // low_delay_mode_flag
+			}
+
+			if (initial_display_delay_present && br.Read(1)) {
+				br.Read(4);
+			}
+		}
+	}
+
+	uint32_t width_bits = br.Read(4) + 1;
+	uint32_t height_bits = br.Read(4) + 1;
+	config.width = br.Read(width_bits) + 1;
+	config.height = br.Read(height_bits) + 1;
+
+	if (!reduced_still_picture_header && br.Read(1)) { // frame_id_numbers_present_flag
+		br.Read(4);
+		br.Read(3);
+	}
+
+	br.Read(1); // use_128x128_superblock
+	br.Read(1); // enable_filter_intra
+	br.Read(1); // enable_intra_edge_filter
+
+	if (!reduced_still_picture_header) {
+		br.Read(1); // enable_interintra_compound
+		br.Read(1); // enable_masked_compound
+		br.Read(1); // enable_warped_motion
+		br.Read(1); // enable_dual_filter
+		bool enable_order_hint = br.Read(1);
+		if (enable_order_hint) {
+			br.Read(1); // enable_jnt_comp
+			br.Read(1); // enable_ref_frame_mvs
+		}
+
+		uint32_t force_screen_content_tools = 2;
+		if (!br.Read(1)) { // seq_choose_screen_content_tools
+			force_screen_content_tools = br.Read(1);
+		}
+		if (force_screen_content_tools > 0 && !br.Read(1)) { // seq_choose_integer_mv
+			br.Read(1);                                      // seq_force_integer_mv
+		}
+
+		if (enable_order_hint) {
+			br.Read(3); // order_hint_bits_minus_1
+		}
+	}
+
+	br.Read(1); // enable_superres
+	br.Read(1); // enable_cdef
+	br.Read(1); // enable_restoration
+
+	// color_config()
+	bool high_bitdepth = br.Read(1);
+	bool twelve_bit = false;
+	if (seq_profile == 2 && high_bitdepth) {
+		twelve_bit = br.Read(1);
+	}
+	uint32_t bit_depth = twelve_bit ? 12 : (high_bitdepth ? 10 : 8);
+
+	bool mono_chrome = seq_profile == 1 ? false : br.Read(1);
+
+	uint32_t color_primaries = 2, transfer_characteristics = 2, matrix_coefficients = 2;
+	if (br.Read(1)) { // color_description_present_flag
+		color_primaries = br.Read(8);
+		transfer_characteristics = br.Read(8);
+		matrix_coefficients = br.Read(8);
+	}
+
+	uint32_t subsampling_x = 1, subsampling_y = 1, chroma_sample_position = 0;
+	if (mono_chrome) {
+		br.Read(1); // color_range
+	} else if (color_primaries == 1 && transfer_characteristics == 13 && matrix_coefficients == 0) {
+		// sRGB: 4:4:4, full range
+		subsampling_x = 0;
+		subsampling_y = 0;
+	} else {
+		br.Read(1); // color_range
+		if (seq_profile == 0) {
+			subsampling_x = 1;
+			subsampling_y = 1;
+		} else if (seq_profile == 1) {
+			subsampling_x = 0;
+			subsampling_y = 0;
+		} else if (bit_depth == 12) {
+			subsampling_x = br.Read(1);
+			subsampling_y = subsampling_x ? br.Read(1) : 0;
+		} else {
+			subsampling_x = 1;
+			subsampling_y = 0;
+		}
+
+		if (subsampling_x && subsampling_y) {
+			chroma_sample_position = br.Read(2);
+		}
+	}
+
+	if (br.Overrun()) {
+		return false;
+	}
+
+	// AV1CodecConfigurationRecord, followed by the sequence header OBU as configOBUs.
+	config.record.clear();
+	config.record.push_back(0x81); // marker, version 1
+	config.record.push_back((uint8_t)((seq_profile << 5) | seq_level_idx));
+	uint8_t flags = (uint8_t)((seq_tier << 7) | (high_bitdepth << 6) | (twelve_bit << 5) | (mono_chrome << 4) |
+				  (subsampling_x << 3) | (subsampling_y << 2) | chroma_sample_position);
+	config.record.push_back(flags);
+	config.record.push_back(0); // no initial_presentation_delay
+
+	config.record.push_back(OBU_SEQUENCE_HEADER << 3 | 0x02); // has_size_field
+	write_leb128(config.record, payload_size);
+	config.record.insert(config.record.end(), payload, payload + payload_size);
+
+	char codec[32];
+	snprintf(codec, sizeof(codec), "av01.%u.%02u%c.%02u", seq_profile, seq_level_idx, seq_tier ? 'H' : 'M',
+			 bit_depth);
+	config.codec = codec;
+
+	return true;
+}
+
+namespace {
+
+struct Vp9Level {
+	uint32_t level;
+	uint64_t max_picture_size;
+	uint64_t max_sample_rate;
+};
+
+// VP9 levels, from the WebM project's level definitions.
+const Vp9Level vp9_levels[] = {
+	{10, 36864, 829440},
+	{11, 73728, 2764800},
+	{20, 122880, 4608000},
+	{21, 245760, 9216000},
+	{30, 552960, 20736000},
+	{31, 983040, 36864000},
+	{40, 2228224, 83558400},
+	{41, 2228224, 160432128},
+	{50, 8912896, 311951360},
+	{51, 8912896, 588251136},
+	{52, 8912896, 1176502272},
+	{60, 35651584, 1176502272},
+	{61, 35651584, 2353004544ULL},
+	{62, 35651584, 4706009088ULL},
+};
+
+const uint32_t VP9_CS_BT_601 = 1;
+const uint32_t VP9_CS_BT_709 = 2;
+const uint32_t VP9_CS_BT_2020 = 5;
+const uint32_t VP9_CS_RGB = 7;
+
+} // namespace
+
+bool parse_vp9_config(const uint8_t *data, size_t size, uint32_t fps_num, uint32_t fps_den, MoQCodecConfig &config)
+{
+	BitReader br(data, size);
+
+	if (br.Read(2) != 2) { // frame_marker
+		return false;
+	}
+
+	uint32_t profile = br.Read(1);
+	profile |= br.Read(1) << 1;
+	if (profile == 3) {
+		br.Read(1);
+	}
+
+	if (br.Read(1)) { // show_existing_frame
+		return false;
+	}
+
+	if (br.Read(1) != 0) { // frame_type: only keyframes carry the color config
+		return false;
+	}
+	br.Read(1); // show_frame
+	br.Read(1); // error_resilient_mode
+
+	if (br.Read(24) != 0x498342) { // frame_sync_code
+		return false;
+	}
+
+	uint32_t bit_depth = 8;
+	if (profile >= 2) {
+		bit_depth = br.Read(1) ? 12 : 10;
+	}
+
+	uint32_t color_space = br.Read(3);
+	uint32_t color_range = 1;
+	uint32_t subsampling_x = 1, subsampling_y = 1;
+
+	if (color_space != VP9_CS_RGB) {
+		color_range = br.Read(1);
+		if (profile == 1 || profile == 3) {
+			subsampling_x = br.Read(1);
+			subsampling_y = br.Read(1);
+			br.Read(1);
+		}
+	} else if (profile == 1 || profile == 3) {
+		subsampling_x = 0;
+		subsampling_y = 0;
+		br.Read(1);
+	}
+
+	config.width = br.Read(16) + 1;
+	config.height = br.Read(16) + 1;
+
+	if (br.Overrun()) {
+		return false;
+	}
+
+	// Smallest level that fits the picture size and luma sample rate.
+	uint64_t picture_size = (uint64_t)config.width * config.height;
+	uint64_t sample_rate = fps_den ? picture_size * fps_num / fps_den : 0;
+	uint32_t level = 62;
+	for (const auto &entry : vp9_levels) {
+		if (picture_size <= entry.max_picture_size && sample_rate <= entry.max_sample_rate) {
+			level = entry.level;
+			break;
+		}
+	}
+
+	// 0 = 4:2:0 vertical, 1 = 4:2:0 colocated, 2 = 4:2:2, 3 = 4:4:4
+	uint32_t chroma_subsampling = 1;
+	if (subsampling_x && !subsampling_y) {
+		chroma_subsampling = 2;
+	} else if (!subsampling_x && !subsampling_y) {
+		chroma_subsampling = 3;
+	}
+
+	uint32_t primaries = 2, transfer = 2, matrix = 2;
+	switch (color_space) {
+	case VP9_CS_BT_601:
+		primaries = 6;
+		transfer = 6;
+		matrix = 6;
+		break;
+	case VP9_CS_BT_709:
+		primaries = 1;
+		transfer = 1;
+		matrix = 1;
+		break;
+	case VP9_CS_BT_2020:
+		primaries = 9;
+		transfer = bit_depth == 12 ? 15 : 14;
+		matrix = 9;
+		break;
+	case VP9_CS_RGB:
+		primaries = 1;
+		transfer = 13;
+		matrix = 0;
+		break;
+	}
+
+	// VPCodecConfigurationRecord (the payload of a version 1 vpcC box, without the FullBox header).
+	config.record = {
+		(uint8_t)profile,
+		(uint8_t)level,
+		(uint8_t)((bit_depth << 4) | (chroma_subsampling << 1) | (color_range & 1)),
+		(uint8_t)primaries,
+		(uint8_t)transfer,
+		(uint8_t)matrix,
+		0,
+		0, // codecIntializationDataSize
+	};
+
+	char codec[32];
+	snprintf(codec, sizeof(codec), "vp09.%02u.%02u.%02u", profile, level, bit_depth);
+	config.codec = codec;
+
+	return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Codec configuration derived from the bitstream, for codecs where OBS doesn't hand us a ready-made
+// decoder configuration record.
+struct MoQCodecConfig {
+    // av1C or vpcC configuration record, passed to libmoq as the track's init data.
+    std::vector<uint8_t> record;
+    // RFC 6381 codec string, e.g. "av01.0.08M.08" or "vp09.00.31.08".
+    std::string codec;
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
+// Builds an av1C record from the first sequence header OBU found in data, which may be the encoder's
+// extra data or a keyframe packet (low overhead bitstream format).
+bool parse_av1_config(const uint8_t *data, size_t size, MoQCodecConfig &config);
+
+// Builds a vpcC record from a VP9 keyframe's uncompressed header. VP9 has no level in the bitstream,
+// so it is derived from the frame size and rate.
+bool parse_vp9_config(const uint8_t *data, size_t size, uint32_t fps_num, uint32_t fps_den, MoQCodecConfig &config);
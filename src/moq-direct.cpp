@@ -0,0 +1,150 @@
+#include "moq-direct.h"
+
+#include <atomic>
+
+#include "logger.h"
+
+struct MoQDirectFeed::State {
+	std::shared_ptr<std::mutex> mutex;
+	std::atomic<bool> enabled{true};
+	PacketCallback callback = nullptr;
+	void *param = nullptr;
+};
+
+namespace {
+
+// Private data of a tap output. The state is set right after the tap is created, before it starts.
+struct MoQDirectTap {
+	obs_output_t *output;
+	std::shared_ptr<MoQDirectFeed::State> state;
+};
+
+const char *const TAP_VIDEO_ID = "moq_direct_video";
+const char *const TAP_AUDIO_ID = "moq_direct_audio";
+
+void stop_tap(void *param)
+{
+	obs_output_t *tap = static_cast<obs_output_t *>(param);
+	obs_output_stop(tap);
+	obs_output_release(tap);
+}
+
+} // namespace
+
+MoQDirectFeed::MoQDirectFeed() : mutex(std::make_shared<std::mutex>()) {}
+
+MoQDirectFeed::~MoQDirectFeed()
+{
+	std::unique_lock<std::mutex> lock = Lock();
+	Stop();
+}
+
+std::unique_lock<std::mutex> MoQDirectFeed::Lock()
+{
+	return std::unique_lock<std::mutex>(*mutex);
+}
+
+bool MoQDirectFeed::Start(obs_output_t *parent, PacketCallback callback, void *param)
+{
+	state = std::make_shared<State>();
+	state->mutex = mutex;
+	state->callback = callback;
+	state->param = param;
+
+	obs_output_t *video_tap = nullptr;
+	obs_output_t *audio_tap = nullptr;
+
+	obs_encoder_t *video_encoder = obs_output_get_video_encoder(parent);
+	if (video_encoder) {
+		video_tap = obs_output_create(TAP_VIDEO_ID, "moq-direct-video", nullptr, nullptr);
+		obs_output_set_video_encoder(video_tap, video_encoder);
+	}
+
+	for (size_t i = 0; i < MAX_OUTPUT_AUDIO_ENCODERS; i++) {
+		obs_encoder_t *audio_encoder = obs_output_get_audio_encoder(parent, i);
+		if (!audio_encoder) {
+			continue;
+		}
+		if (!audio_tap) {
+			audio_tap = obs_output_create(TAP_AUDIO_ID, "moq-direct-audio", nullptr, nullptr);
+		}
+		// Same index as on the parent, so packets carry the same track_idx.
+		obs_output_set_audio_encoder(audio_tap, audio_encoder, i);
+	}
+
+	for (obs_output_t *tap : {video_tap, audio_tap}) {
+		if (!tap) {
+			continue;
+		}
+
+		static_cast<MoQDirectTap *>(obs_obj_get_data(tap))->state = state;
+		taps.push_back(tap);
+
+		if (!obs_output_start(tap)) {
+			LOG_WARNING("Failed to start direct packet output %s", obs_output_get_name(tap));
+			Stop();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void MoQDirectFeed::Stop()
+{
+	if (state) {
+		state->enabled.store(false, std::memory_order_release);
+		state.reset();
+	}
+
+	// Releasing a tap waits until it is unhooked from its encoders, which can't happen while one of
+	// them is inside the callback, as it is when the output stops itself on a packet.
+	for (obs_output_t *tap : taps) {
+		obs_queue_task(OBS_TASK_DESTROY, stop_tap, tap, false);
+	}
+	taps.clear();
+}
+
+void MoQDirectFeed::Register()
+{
+	struct obs_output_info info = {};
+	info.id = TAP_VIDEO_ID;
+	info.flags = OBS_OUTPUT_VIDEO | OBS_OUTPUT_ENCODED;
+	info.get_name = [](void *) -> const char * {
+		return "MoQ Direct Packets";
+	};
+	info.create = [](obs_data_t *, obs_output_t *output) -> void * {
+		return new MoQDirectTap{output, nullptr};
+	};
+	info.destroy = [](void *data) {
+		delete static_cast<MoQDirectTap *>(data);
+	};
+	info.start = [](void *data) -> bool {
+		obs_output_t *output = static_cast<MoQDirectTap *>(data)->output;
+		if (!obs_output_can_begin_data_capture(output, 0) || !obs_output_initialize_encoders(output, 0)) {
+			return false;
+		}
+		return obs_output_begin_data_capture(output, 0);
+	};
+	info.stop = [](void *data, uint64_t) {
+		obs_output_end_data_capture(static_cast<MoQDirectTap *>(data)->output);
+	};
+	info.encoded_packet = [](void *data, struct encoder_packet *packet) {
+		const std::shared_ptr<MoQDirectFeed::State> &state = static_cast<MoQDirectTap *>(data)->state;
+		if (!state || !packet) {
+			// Encoder errors reach the parent output too, which handles them.
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(*state->mutex);
+		if (state->enabled.load(std::memory_order_acquire)) {
+			state->callback(state->param, packet);
+		}
+	};
+
+	obs_register_output(&info);
+
+	info.id = TAP_AUDIO_ID;
+	info.flags = OBS_OUTPUT_AUDIO | OBS_OUTPUT_MULTI_TRACK | OBS_OUTPUT_ENCODED;
+	obs_register_output(&info);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <obs-module.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Delivers an output's encoder packets as soon as each encoder produces them.
+//
+// OBS interleaves the packets of outputs that carry both audio and video, holding each one until every
+// other track has caught up with it. MoQ publishes every track independently, so it doesn't need that.
+// There is no public way to receive an encoder's packets without an output, so the feed attaches small
+// private outputs ("taps") with a single kind of media to the same encoders; OBS doesn't interleave
+// those. The parent output keeps receiving the interleaved copies, which it can use for comparison.
+class MoQDirectFeed
+{
+      public:
+    typedef void (*PacketCallback)(void *param, struct encoder_packet *packet);
+
+    MoQDirectFeed();
+    ~MoQDirectFeed();
+
+    // Starts taps on the parent's video and audio encoders. The callback runs on the encoder threads,
+    // one packet at a time, with the feed's lock held.
+    bool Start(obs_output_t *parent, PacketCallback callback, void *param);
+
+    // Stops delivering packets; the taps themselves are stopped on OBS's destroy thread. Safe to call
+    // from the callback. To be sure no callback is still running, call it with Lock() held.
+    void Stop();
+
+    bool Active() const
+    {
+        return state != nullptr;
+    }
+
+    // Serializes with the callback.
+    std::unique_lock<std::mutex> Lock();
+
+    static void Register();
+
+    // Shared with the taps, which may outlive the feed until OBS gets around to stopping them.
+    struct State;
+
+      private:
+    std::shared_ptr<State> state;
+    std::vector<obs_output_t *> taps;
+    // Kept across Stop(), so Lock() still serializes with a callback that was already running.
+    std::shared_ptr<std::mutex> mutex;
+};
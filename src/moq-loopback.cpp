@@ -0,0 +1,137 @@
+#include "moq-loopback.h"
+
+#include <obs-module.h>
+
+#include "logger.h"
+
+extern "C" {
+#include "moq.h"
+}
+
+MoQLoopback::~MoQLoopback()
+{
+	Stop();
+}
+
+bool MoQLoopback::Start(const std::string &url)
+{
+	Stop();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	connected = false;
+	failed = false;
+	subscribed = false;
+	bytes = 0;
+
+	origin = moq_origin_create();
+	if (origin < 0) {
+		return false;
+	}
+
+	session = moq_session_connect(url.data(), url.size(), 0, origin, OnStatus, this);
+	if (session < 0) {
+		LOG_WARNING("Loopback: failed to connect to %s: %d", url.c_str(), session);
+		moq_origin_close(origin);
+		origin = -1;
+		return false;
+	}
+
+	active = true;
+	return true;
+}
+
+bool MoQLoopback::Subscribe(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!active || consume >= 0) {
+		return consume >= 0;
+	}
+
+	consume = moq_origin_consume(origin, path.data(), path.size());
+	if (consume < 0) {
+		LOG_WARNING("Loopback: failed to consume %s: %d", path.c_str(), consume);
+		return false;
+	}
+
+	if (moq_consume_catalog(consume, OnCatalog, this) < 0) {
+		LOG_WARNING("Loopback: failed to subscribe to the catalog of %s", path.c_str());
+		moq_consume_close(consume);
+		consume = -1;
+		return false;
+	}
+
+	subscribed = true;
+	return true;
+}
+
+void MoQLoopback::Stop()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	active = false;
+
+	if (track >= 0) {
+		moq_consume_video_close(track);
+		track = -1;
+	}
+	if (catalog >= 0) {
+		moq_consume_catalog_close(catalog);
+		catalog = -1;
+	}
+	if (consume >= 0) {
+		moq_consume_close(consume);
+		consume = -1;
+	}
+	if (session >= 0) {
+		moq_session_close(session);
+		session = -1;
+	}
+	if (origin >= 0) {
+		moq_origin_close(origin);
+		origin = -1;
+	}
+}
+
+void MoQLoopback::OnStatus(void *user_data, int32_t error_code)
+{
+	auto self = static_cast<MoQLoopback *>(user_data);
+	if (error_code == 0) {
+		self->connected.store(true, std::memory_order_release);
+	} else {
+		self->failed.store(true, std::memory_order_release);
+	}
+}
+
+// Only the video track is read back; it carries nearly all of the bytes.
+void MoQLoopback::OnCatalog(void *user_data, int32_t catalog)
+{
+	auto self = static_cast<MoQLoopback *>(user_data);
+	if (catalog < 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(self->mutex);
+	if (!self->active || self->catalog >= 0) {
+		moq_consume_catalog_close(catalog);
+		return;
+	}
+
+	self->catalog = catalog;
+	self->track = moq_consume_video_ordered(catalog, 0, 0, OnFrame, self);
+	if (self->track < 0) {
+		LOG_WARNING("Loopback: failed to subscribe to the video track: %d", self->track);
+	}
+}
+
+void MoQLoopback::OnFrame(void *user_data, int32_t frame_id)
+{
+	auto self = static_cast<MoQLoopback *>(user_data);
+	if (frame_id < 0) {
+		return;
+	}
+
+	struct moq_frame frame;
+	if (moq_consume_frame_chunk(frame_id, 0, &frame) >= 0) {
+		self->bytes.fetch_add(frame.payload_size, std::memory_order_relaxed);
+	}
+	moq_consume_frame_close(frame_id);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Subscribes to one of our own broadcasts over a separate session and counts the bytes the relay delivers
+// back. libmoq accepts published objects into a local queue without saying when they leave, so this is
+// the only way to see what actually got through. Used by the uplink probe and the bandwidth test.
+//
+// The read-back comes down the same link, so on a link with a slower downlink it under-reads.
+class MoQLoopback
+{
+      public:
+    MoQLoopback() = default;
+    ~MoQLoopback();
+
+    MoQLoopback(const MoQLoopback &) = delete;
+    MoQLoopback &operator=(const MoQLoopback &) = delete;
+
+    // Connects to url; Subscribe() once Connected().
+    bool Start(const std::string &url);
+    // Starts counting the broadcast at path. Returns false if libmoq refused the subscription.
+    bool Subscribe(const std::string &path);
+    void Stop();
+
+    bool Connected() const
+    {
+        return connected.load(std::memory_order_acquire);
+    }
+
+    bool Failed() const
+    {
+        return failed.load(std::memory_order_acquire);
+    }
+
+    bool Subscribed() const
+    {
+        return subscribed.load(std::memory_order_acquire);
+    }
+
+    // Payload bytes received since Start().
+    uint64_t Bytes() const
+    {
+        return bytes.load(std::memory_order_relaxed);
+    }
+
+      private:
+    static void OnStatus(void *user_data, int32_t error_code);
+    static void OnCatalog(void *user_data, int32_t catalog);
+    static void OnFrame(void *user_data, int32_t frame_id);
+
+    // Guards the handles, which libmoq callbacks set while Stop() closes them.
+    std::mutex mutex;
+    bool active = false;
+    int32_t origin = -1;
+    int32_t session = -1;
+    int32_t consume = -1;
+    int32_t catalog = -1;
+    int32_t track = -1;
+
+    std::atomic<bool> connected{false};
+    std::atomic<bool> failed{false};
+    std::atomic<bool> subscribed{false};
+    std::atomic<uint64_t> bytes{0};
+};
@@ -1,7 +1,18 @@
+#include <obs-avc.h>
+#include <obs-hevc.h>
 #include <obs.hpp>
 
+#include <algorithm>
+#include <memory>
+#include <random>
+
+#include "moq-annexb.h"
+#include "moq-capture-time.h"
+#include "moq-codec.h"
+#include "moq-direct.h"
+#include "moq-recorder.h"
 #include "moq-output.h"
-#include "util/util_uint64.h"
+#include "util/platform.h"
 
 extern "C" {
 #include "moq.h"
@@ -12,21 +23,85 @@ MoQOutput::MoQOutput(obs_data_t *, obs_output_t *output)
 	  server_url(),
 	  path(),
 	  total_bytes_sent(0),
+	  total_packets_sent(0),
+	  copied_bytes(0),
 	  connect_time_ms(0),
-	  origin(moq_origin_create()),
+	  first_object_ms(-1),
+	  first_keyframe_ms(-1),
+	  connect_start_us(0),
+	  connect_pending(false),
+	  preconnect_enabled(false),
+	  replaying_preconnect(false),
+	  stop_ts_us(0),
+	  stop_deadline_us(0),
+	  stop_flush_us(0),
+	  stop_bytes_base(0),
+	  stop_dropped_base(0),
+	  latency_profile(""),
+	  bwtest(false),
+	  length_prefixed(false),
+	  direct_packets(false),
+	  flight_recorder(false),
+	  flight_recorder_dumped(0),
+	  session_lost(false),
+	  capture_timestamps(false),
+	  capture_time_failures(0),
+	  audio_frames_per_object(1),
+	  audio_aggregation_max_us(0),
 	  broadcast(moq_publish_create()),
-	  session(0),
-	  video(0),
-	  audio(0)
+	  migration_start_us(0),
+	  migrations(0),
+	  migration_ms(-1),
+	  migration_handshake_ms(-1),
+	  video(),
+	  audio()
 {
+	video.name = "video";
+	for (size_t i = 0; i < audio.size(); i++) {
+		audio[i].name = "audio" + std::to_string(i);
+	}
+
+	proc_handler_t *ph = obs_output_get_proc_handler(output);
+	proc_handler_add(
+		ph, "void get_stats(out string stats)",
+		[](void *data, calldata_t *cd) {
+			OBSDataAutoRelease stats = obs_data_create();
+			static_cast<MoQOutput *>(data)->GetStats(stats);
+			calldata_set_string(cd, "stats", obs_data_get_json(stats));
+		},
+		this);
+	proc_handler_add(
+		ph, "void dump_flight_recorder(out string path)",
+		[](void *data, calldata_t *cd) {
+			std::string path = static_cast<MoQOutput *>(data)->DumpFlightRecorder("requested", true);
+			calldata_set_string(cd, "path", path.c_str());
+		},
+		this);
+	proc_handler_add(
+		ph, "void migrate(in string url, out bool accepted)",
+		[](void *data, calldata_t *cd) {
+			const char *url = calldata_string(cd, "url");
+			bool accepted = static_cast<MoQOutput *>(data)->Migrate(url ? url : "");
+			calldata_set_bool(cd, "accepted", accepted);
+		},
+		this);
 }
 
 MoQOutput::~MoQOutput()
 {
+	// Tracks, then the broadcast, then the session.
+	{
+		std::unique_lock<std::mutex> lock = direct.Lock();
+		Stop();
+	}
+
 	moq_publish_close(broadcast);
-	moq_origin_close(origin);
+}
 
-	Stop();
+// Reads a millisecond service setting; negative values count as 0 (off).
+static uint64_t get_duration_us(obs_data_t *settings, const char *name)
+{
+	return (uint64_t)std::max(obs_data_get_int(settings, name), 0LL) * 1000;
 }
 
 bool MoQOutput::Start()
@@ -57,70 +132,283 @@ bool MoQOutput::Start()
 
 	path = obs_service_get_connect_info(service, OBS_SERVICE_CONNECT_INFO_STREAM_KEY);
 
-	const obs_encoder_t *encoder = obs_output_get_video_encoder2(output, 0);
+	OBSDataAutoRelease service_settings = obs_service_get_settings(service);
 
-	if (!encoder) {
+	// Publish the real stream under a random name nobody is subscribed to, so the uplink can be
+	// measured before going live without exposing the stream.
+	bwtest = obs_data_get_bool(service_settings, "bwtest");
+	if (bwtest) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "/bwtest-%08x", (unsigned)std::random_device()());
+		path += suffix;
+		LOG_INFO("Bandwidth test mode, publishing to a throwaway path");
+	}
+	direct_packets = obs_data_get_bool(service_settings, "direct_packets");
+	flight_recorder = obs_data_get_bool(service_settings, "flight_recorder");
+	timestamps.Reset(obs_data_get_bool(service_settings, "wallclock_timestamps"), direct_packets);
+
+	// The catalog has no field for it, so the latency profile the service applied to the encoders is
+	// reported in the log and stats.
+	latency_profile = "";
+	for (const char *name : {"ultra_low", "low", "quality", "none"}) {
+		if (strcmp(obs_data_get_string(service_settings, "profile"), name) == 0) {
+			latency_profile = name;
+			LOG_INFO("Latency profile: %s", name);
+		}
+	}
+
+	stop_flush_us = get_duration_us(service_settings, "stop_flush_ms");
+	length_prefixed = obs_data_get_bool(service_settings, "length_prefixed");
+	capture_timestamps = obs_data_get_bool(service_settings, "capture_timestamps");
+	capture_time_failures = 0;
+
+	interleave_delay.Reset();
+
+	uint64_t video_deadline_us = get_duration_us(service_settings, "group_deadline_ms");
+	uint64_t audio_deadline_us = get_duration_us(service_settings, "audio_deadline_ms");
+	// Stream Delay hands packets over long after capture without touching sys_dts_usec, so every object
+	// would look late.
+	if (obs_output_get_active_delay(output) > 0 && (video_deadline_us || audio_deadline_us)) {
+		LOG_INFO("Stream delay is on; ignoring the video and audio deadlines");
+		video_deadline_us = 0;
+		audio_deadline_us = 0;
+	}
+
+	long long frames_per_object = obs_data_get_int(service_settings, "audio_frames_per_object");
+	audio_frames_per_object = (size_t)std::max(frames_per_object, 1LL);
+	audio_aggregation_max_us = get_duration_us(service_settings, "audio_aggregation_max_ms");
+	if (audio_frames_per_object > 1) {
+		LOG_INFO("Aggregating up to %zu Opus frames per audio object (max %llu ms added latency)",
+			 audio_frames_per_object, (unsigned long long)(audio_aggregation_max_us / 1000));
+	}
+
+	uint32_t flags = obs_output_get_flags(output);
+	if ((flags & OBS_OUTPUT_VIDEO) && !obs_output_get_video_encoder2(output, 0)) {
 		LOG_ERROR("Failed to get video encoder");
 		return false;
 	}
 
 	LOG_INFO("Connecting to MoQ server: %s", server_url.c_str());
 
-	connect_start = std::chrono::steady_clock::now();
-
-	// Create a callback to log when the session is connected or closed
-	auto session_connect_callback = [](void *user_data, int error_code) {
-		auto self = static_cast<MoQOutput *>(user_data);
+	total_bytes_sent = 0;
+	total_packets_sent = 0;
+	copied_bytes = 0;
+	connect_time_ms = 0;
+	first_object_ms = -1;
+	first_keyframe_ms = -1;
+	stop_ts_us = 0;
+	migrations = 0;
+	migration_ms = -1;
+	migration_handshake_ms = -1;
+	start_time = std::chrono::steady_clock::now();
+	bandwidth.Reset(os_gettime_ns() / 1000);
+	video.stats.Reset();
+	video.info.Reset();
+	video.timeline.Reset();
+	video.deadline_us = video_deadline_us;
+	video.reconfigurations = 0;
+	video.group_expired = false;
+	video.deadline_misses = 0;
+	for (auto &track : audio) {
+		track.stats.Reset();
+		track.info.Reset();
+		track.timeline.Reset();
+		track.aggregator.Configure(1, 0);
+		track.deadline_us = audio_deadline_us;
+		track.deadline_misses = 0;
+	}
 
-		if (error_code == 0) {
-			auto elapsed = std::chrono::steady_clock::now() - self->connect_start;
-			self->connect_time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
-			LOG_INFO("MoQ session established (%d ms): %s", self->connect_time_ms,
-				 self->server_url.c_str());
-		} else {
-			LOG_INFO("MoQ session closed (%d): %s", error_code, self->server_url.c_str());
-		}
-	};
+	connect_start_us = os_gettime_ns() / 1000;
+	connect_pending = true;
+	preconnect_enabled = obs_data_get_bool(service_settings, "preconnect_buffer");
+	preconnect.Reset(flags & OBS_OUTPUT_VIDEO);
 
-	// Start establishing a session with the MoQ server
-	// NOTE: You could publish the same broadcasts to multiple sessions if you want (redundant ingest).
-	session = moq_session_connect(server_url.data(), server_url.size(), origin, 0, session_connect_callback, this);
-	if (session < 0) {
-		LOG_ERROR("Failed to initialize MoQ server: %d", session);
+	// Start establishing a session with the MoQ server, or attach to the one the service pre-warmed.
+	session = MoQSessionPool::Acquire(server_url);
+	if (!session->Usable()) {
+		MoQSessionPool::Release(session);
 		return false;
 	}
 
 	LOG_INFO("Publishing broadcast: %s", path.c_str());
+	session_lost = false;
+	RecordEvent(MoQFlightEventType::Start, nullptr);
 
-	// Publish the broadcast to the origin we created.
-	// TODO: There is currently no unpublish function.
-	auto result = moq_origin_publish(origin, path.data(), path.size(), broadcast);
+	// Publish the broadcast to the session's origin. There is no unpublish function; the broadcast is
+	// closed instead when the output stops.
+	auto result = moq_origin_publish(session->origin, path.data(), path.size(), broadcast);
 	if (result < 0) {
 		LOG_ERROR("Failed to publish broadcast to session: %d", result);
+		MoQSessionPool::Release(session);
 		return false;
 	}
 
+	// Read the stream back through the relay to see what it actually delivered. Started only now, so no
+	// failed start leaves the second session open.
+	if (bwtest) {
+		loopback.Start(server_url);
+	}
+
+	// Create the tracks now, while the session handshake is in flight, rather than on the output
+	// thread when the first keyframe arrives. Tracks whose codec config isn't available yet are
+	// created on their first packet instead.
+	if (flags & OBS_OUTPUT_VIDEO) {
+		VideoInit(true, nullptr);
+	}
+
+	for (size_t i = 0; i < audio.size(); i++) {
+		if (obs_output_get_audio_encoder(output, i)) {
+			AudioInit(i, true);
+		}
+	}
+
+	// OBS only interleaves outputs that carry both video and audio.
+	bool has_audio = false;
+	for (size_t i = 0; i < audio.size(); i++) {
+		has_audio = has_audio || obs_output_get_audio_encoder(output, i);
+	}
+
+	if (direct_packets && (flags & OBS_OUTPUT_VIDEO) && has_audio) {
+		auto callback = [](void *param, struct encoder_packet *packet) {
+			static_cast<MoQOutput *>(param)->DirectData(packet);
+		};
+		if (direct.Start(output, callback, this)) {
+			LOG_INFO("Publishing packets as the encoders produce them, bypassing interleaving");
+		} else {
+			LOG_WARNING("Falling back to interleaved packets");
+			direct_packets = false;
+		}
+	} else {
+		direct_packets = false;
+	}
+
 	obs_output_begin_data_capture(output, 0);
 
 	return true;
 }
 
+// Called by OBS with the time Stop Streaming was pressed, or 0 to stop right away. Frames captured
+// before that time are still in the encoders and the interleaver, so keep publishing until the first
+// packet captured after it arrives (the output thread then calls Stop()), for at most stop_flush_ms.
+void MoQOutput::RequestStop(uint64_t ts)
+{
+	std::unique_lock<std::mutex> lock = direct.Lock();
+
+	if (ts == 0 || stop_flush_us == 0 || !session) {
+		Stop();
+		return;
+	}
+
+	stop_bytes_base = total_bytes_sent;
+	stop_dropped_base = GetDroppedBytes();
+	stop_deadline_us = os_gettime_ns() / 1000 + stop_flush_us;
+	stop_ts_us.store(ts / 1000, std::memory_order_release);
+
+	LOG_INFO("Stopping, publishing frames captured before the stop request (up to %llu ms)",
+		 (unsigned long long)(stop_flush_us / 1000));
+}
+
 void MoQOutput::Stop(bool signal)
 {
-	// Close the session
-	if (session > 0) {
-		moq_session_close(session);
-		session = 0;
+	// Publish audio frames still waiting to be aggregated before their tracks are closed.
+	for (auto &track : audio) {
+		if (track.handle > 0 && track.aggregator.Enabled()) {
+			std::vector<MoQAudioObject> objects;
+			track.aggregator.Flush(objects);
+			PublishAudioObjects(track, objects);
+		}
 	}
 
-	if (video > 0) {
-		moq_publish_media_close(video);
-		video = 0;
+	if (session) {
+		RecordEvent(MoQFlightEventType::Stop, nullptr);
+		if (recorder.Errors() > flight_recorder_dumped) {
+			DumpFlightRecorder("errors during the stream");
+		}
+
+		// libmoq copies the payload once inside moq_publish_media_frame; anything above that is ours.
+		uint64_t bytes = total_bytes_sent;
+		uint64_t copied = copied_bytes;
+		LOG_INFO("Published %llu packets (%llu bytes), plugin copies: %llu bytes (%.2f payload copies per packet)",
+			 (unsigned long long)total_packets_sent, (unsigned long long)bytes, (unsigned long long)copied,
+			 bytes ? (double)copied / (double)bytes : 0.0);
+
+		if (bwtest) {
+			if (bandwidth.samples == 0) {
+				LOG_WARNING("Bandwidth test stopped before any measurement was taken");
+			} else if (bandwidth.LinkLimited()) {
+				LOG_INFO("Bandwidth test: the link is the limit: %llu kbps sent, %.0f%% of the "
+					 "video delivered (%llu kbps, min %llu kbps) over %llu s, "
+					 "recommended bitrate %llu kbps",
+					 (unsigned long long)(bandwidth.AverageRate() / 1000),
+					 bandwidth.DeliveryRatio() * 100.0,
+					 (unsigned long long)(bandwidth.AverageDeliveredRate() / 1000),
+					 (unsigned long long)(bandwidth.min_delivered_bps / 1000),
+					 (unsigned long long)bandwidth.samples,
+					 (unsigned long long)bandwidth.RecommendedKbps());
+			} else {
+				LOG_INFO("Bandwidth test: the link carried the configured %llu kbps (%.0f%% of "
+					 "the video delivered over %llu s); its capacity may be higher, see "
+					 "uplink_probe",
+					 (unsigned long long)(bandwidth.AverageRate() / 1000),
+					 bandwidth.DeliveryRatio() * 100.0, (unsigned long long)bandwidth.samples);
+			}
+		}
+
+		if (direct_packets) {
+			int64_t delay_us = interleave_delay.AverageUs();
+			if (delay_us >= 0) {
+				LOG_INFO("Direct packets: interleaving would have added %.1f ms per packet on average",
+					 delay_us / 1000.0);
+			}
+		}
+
+		if (stop_ts_us != 0) {
+			// What happens to objects still queued in libmoq isn't reported; they get until the session
+			// is closed to leave.
+			LOG_INFO("Stop flush: %llu bytes published after the stop request, %llu bytes abandoned, "
+				 "session kept open for %llu ms",
+				 (unsigned long long)(total_bytes_sent - stop_bytes_base),
+				 (unsigned long long)(GetDroppedBytes() - stop_dropped_base),
+				 (unsigned long long)(stop_flush_us / 1000));
+		}
+	}
+
+	if (!preconnect.Empty()) {
+		LOG_WARNING("Stopped before the session was established, discarding buffered packets");
+		preconnect.Discard();
+	}
+
+	// Late packets from the encoders are ignored from here on; the taps are stopped asynchronously.
+	direct.Stop();
+	loopback.Stop();
+
+	if (video.handle > 0) {
+		moq_publish_media_close(video.handle);
+		video.handle = 0;
+	}
+
+	for (auto &track : audio) {
+		if (track.handle > 0) {
+			moq_publish_media_close(track.handle);
+			track.handle = 0;
+		}
+	}
+
+	// Close the broadcast so it ends on the relay, and hand the session back. A warm session stays
+	// connected for the next Start(); any other is closed once libmoq had stop_flush_ms to drain it.
+	if (session) {
+		moq_publish_close(broadcast);
+		broadcast = moq_publish_create();
+		MoQSessionPool::Release(session, stop_ts_us != 0 ? stop_flush_us : 0);
+		if (migrating) {
+			LOG_INFO("Stopped before migrating to %s", migrating->url.c_str());
+			MoQSessionPool::Release(migrating);
+		}
 	}
 
-	if (audio > 0) {
-		moq_publish_media_close(audio);
-		audio = 0;
+	{
+		std::lock_guard<std::mutex> lock(migration_mutex);
+		migration_url.clear();
 	}
 
 	if (signal) {
@@ -130,14 +418,99 @@ void MoQOutput::Stop(bool signal)
 	return;
 }
 
+// Packets from OBS, after interleaving. With direct packets on, the same packets were already published
+// by DirectData(), so these only measure how long the interleaver held them.
+//
+// The direct feed's lock is taken in every mode: RequestStop() may call Stop() on the UI thread while
+// packets are still arriving here, and Stop() releases the session and closes the tracks.
 void MoQOutput::Data(struct encoder_packet *packet)
+{
+	std::unique_lock<std::mutex> lock = direct.Lock();
+
+	if (direct_packets) {
+		if (!session) {
+			return;
+		}
+
+		if (packet) {
+			interleave_delay.Add(true, os_gettime_ns() / 1000, packet->sys_dts_usec);
+			return;
+		}
+	}
+
+	Publish(packet);
+}
+
+// Packets straight from the encoders, called with the direct feed's lock held, so only one encoder
+// thread at a time gets here. Timestamps stay monotonic per track (MoQTimestamps::Normalize), which is
+// all MoQ needs since each track is published independently.
+void MoQOutput::DirectData(struct encoder_packet *packet)
+{
+	if (session) {
+		interleave_delay.Add(false, os_gettime_ns() / 1000, packet->sys_dts_usec);
+	}
+
+	Publish(packet);
+}
+
+void MoQOutput::Publish(struct encoder_packet *packet)
 {
 	if (!packet) {
+		RecordEvent(MoQFlightEventType::EncoderError, nullptr);
+		DumpFlightRecorder("encoder error");
 		Stop(false);
 		obs_output_signal_stop(output, OBS_OUTPUT_ENCODE_ERROR);
 		return;
 	}
 
+	if (!session) {
+		// Already stopped; nothing more is published.
+		return;
+	}
+
+	uint64_t stop_ts = stop_ts_us.load(std::memory_order_acquire);
+	if (stop_ts != 0 && ((uint64_t)packet->sys_dts_usec >= stop_ts || os_gettime_ns() / 1000 >= stop_deadline_us)) {
+		Stop();
+		return;
+	}
+
+	if (connect_pending) {
+		int connect_time = session->ConnectTimeSince(connect_start_us);
+		if (connect_time >= 0) {
+			connect_time_ms = connect_time;
+			connect_pending = false;
+			RecordEvent(MoQFlightEventType::SessionConnected, nullptr, 0, false, connect_time);
+		}
+	}
+
+	StepMigration(packet);
+
+	if (!session_lost && !session->Usable()) {
+		session_lost = true;
+		RecordEvent(MoQFlightEventType::SessionClosed, nullptr);
+		DumpFlightRecorder("session closed");
+	}
+
+	// What libmoq does with objects published before the handshake completes is undefined, so hold them
+	// until it has, then send the newest group.
+	if (connect_pending && preconnect_enabled) {
+		preconnect.Push(packet);
+		return;
+	}
+
+	if (!preconnect.Empty()) {
+		ReleasePreconnect();
+	}
+
+	Dispatch(packet);
+
+	if (bwtest) {
+		SampleBandwidthTest(os_gettime_ns() / 1000);
+	}
+}
+
+void MoQOutput::Dispatch(struct encoder_packet *packet)
+{
 	if (packet->type == OBS_ENCODER_AUDIO) {
 		AudioData(packet);
 	} else if (packet->type == OBS_ENCODER_VIDEO) {
@@ -145,92 +518,773 @@ void MoQOutput::Data(struct encoder_packet *packet)
 	}
 }
 
+// Publishes what the pre-connect buffer held, oldest first. These packets are as old as the handshake
+// took, but they are the newest group, so they aren't held to the deadlines.
+void MoQOutput::ReleasePreconnect()
+{
+	uint64_t trimmed = preconnect.trimmed;
+	uint64_t received = preconnect.received;
+	LOG_INFO("Session established after %d ms: publishing %llu buffered packets, %llu trimmed (%llu bytes)",
+		 GetConnectTime(), (unsigned long long)(received - trimmed), (unsigned long long)trimmed,
+		 (unsigned long long)preconnect.trimmed_bytes);
+
+	replaying_preconnect = true;
+	while (!preconnect.Empty() && session) {
+		MoQPacket packet = preconnect.Pop();
+		Dispatch(packet.Get());
+	}
+	replaying_preconnect = false;
+}
+
+bool MoQOutput::Migrate(const std::string &url)
+{
+	std::unique_lock<std::mutex> lock = direct.Lock();
+	if (!session || url.empty() || stop_ts_us != 0) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> migration_lock(migration_mutex);
+	migration_url = url;
+	return true;
+}
+
+// Called on the output thread for every packet. Starts a requested migration by connecting to the new
+// relay, and completes it at a video keyframe: the old session's broadcast is closed there, so it ends
+// after a complete group, and a new broadcast is published on the new session starting with that
+// keyframe. The old session lingers for stop_flush_ms so libmoq can send what it queued.
+void MoQOutput::StepMigration(const struct encoder_packet *packet)
+{
+	std::string url;
+	{
+		std::lock_guard<std::mutex> lock(migration_mutex);
+		url.swap(migration_url);
+	}
+
+	if (migrating && url == migrating->url) {
+		url.clear();
+	}
+
+	if (!url.empty()) {
+		if (migrating) {
+			LOG_INFO("Abandoning migration to %s", migrating->url.c_str());
+			MoQSessionPool::Retire(migrating, 0);
+		}
+
+		if (url == session->url) {
+			LOG_INFO("Already publishing to %s", url.c_str());
+			return;
+		}
+
+		migration_start_us = os_gettime_ns() / 1000;
+		migrating = MoQSessionPool::Acquire(url);
+		if (!migrating->Usable()) {
+			LOG_ERROR("Failed to migrate to %s: %d", url.c_str(), migrating->session);
+			MoQSessionPool::Retire(migrating, 0);
+			return;
+		}
+
+		LOG_INFO("Migrating broadcast %s to %s", path.c_str(), url.c_str());
+	}
+
+	if (!migrating) {
+		return;
+	}
+
+	if (!migrating->Usable()) {
+		LOG_WARNING("Migration to %s failed: the session closed; staying on %s", migrating->url.c_str(),
+			    session->url.c_str());
+		MoQSessionPool::Retire(migrating, 0);
+		return;
+	}
+
+	int handshake_ms = migrating->ConnectTimeSince(migration_start_us);
+	if (handshake_ms < 0) {
+		return;
+	}
+
+	// Switch where a group starts, so the old relay's last group is complete. Without video, any packet.
+	bool keyframe = packet->type == OBS_ENCODER_VIDEO && packet->keyframe;
+	if (!keyframe && video.handle > 0) {
+		return;
+	}
+
+	int next_broadcast = moq_publish_create();
+	int result = moq_origin_publish(migrating->origin, path.data(), path.size(), next_broadcast);
+	if (result < 0) {
+		LOG_ERROR("Failed to publish broadcast to %s: %d; staying on %s", migrating->url.c_str(), result,
+			  session->url.c_str());
+		moq_publish_close(next_broadcast);
+		MoQSessionPool::Retire(migrating, 0);
+		return;
+	}
+
+	// End the old broadcast before this keyframe. Its tracks are recreated on the new broadcast as their
+	// next packets arrive, starting with this keyframe for video.
+	for (auto &track : audio) {
+		if (track.handle > 0 && track.aggregator.Enabled()) {
+			std::vector<MoQAudioObject> objects;
+			track.aggregator.Flush(objects);
+			PublishAudioObjects(track, objects);
+		}
+	}
+
+	if (video.handle > 0) {
+		moq_publish_media_close(video.handle);
+		video.handle = 0;
+	}
+
+	for (auto &track : audio) {
+		if (track.handle > 0) {
+			moq_publish_media_close(track.handle);
+			track.handle = 0;
+		}
+	}
+
+	moq_publish_close(broadcast);
+	broadcast = next_broadcast;
+
+	uint64_t now_us = os_gettime_ns() / 1000;
+	int switch_ms = (int)((now_us - migration_start_us) / 1000);
+	LOG_INFO("Migrated from %s to %s in %d ms (handshake %d ms)", session->url.c_str(), migrating->url.c_str(),
+		 switch_ms, handshake_ms);
+
+	MoQSessionPool::Retire(session, stop_flush_us);
+	session = std::move(migrating);
+	server_url = session->url;
+	session_lost = false;
+	migrations++;
+	migration_ms = switch_ms;
+	migration_handshake_ms = handshake_ms;
+	RecordEvent(MoQFlightEventType::Migrated, nullptr, 0, false, switch_ms);
+}
+
+uint8_t MoQOutput::TrackIndex(const MoQTrack &track) const
+{
+	return &track == &video ? 0 : (uint8_t)(1 + (&track - audio.data()));
+}
+
+void MoQOutput::RecordEvent(MoQFlightEventType type, const MoQTrack *track, size_t size, bool keyframe,
+			    int32_t result)
+{
+	if (flight_recorder) {
+		recorder.Record(type, track ? TrackIndex(*track) : 0, os_gettime_ns() / 1000, 0, size, keyframe,
+				result);
+	}
+}
+
+struct MoQFlightDump {
+	std::string reason;
+	std::string dir;
+	std::string name;
+	uint64_t count;
+	std::vector<uint8_t> snapshot;
+};
+
+static bool save_flight_dump(const MoQFlightDump &dump)
+{
+	std::string file = dump.dir + "/" + dump.name;
+	if (!MoQFlightRecorder::Save(dump.dir, dump.name, dump.snapshot)) {
+		LOG_ERROR("Failed to write flight recorder to %s", file.c_str());
+		return false;
+	}
+
+	LOG_INFO("Flight recorder (%s): %llu events written to %s", dump.reason.c_str(),
+		 (unsigned long long)dump.count, file.c_str());
+	return true;
+}
+
+static void save_flight_dump_task(void *param)
+{
+	std::unique_ptr<MoQFlightDump> dump(static_cast<MoQFlightDump *>(param));
+	save_flight_dump(*dump);
+}
+
+// Snapshots the flight recorder and writes it to the plugin's config directory, keeping the newest
+// MoQFlightRecorder::MAX_DUMPS files. Returns the file's path; with wait set, an empty string if it
+// couldn't be written.
+std::string MoQOutput::DumpFlightRecorder(const char *reason, bool wait)
+{
+	if (!flight_recorder) {
+		return "";
+	}
+
+	auto dump = std::make_unique<MoQFlightDump>();
+	char *dir = obs_module_config_path("flight-recorder");
+	char *name = os_generate_formatted_filename("bin", false, "moq-flight-%CCYY%MM%DD-%hh%mm%ss");
+	dump->reason = reason;
+	dump->dir = dir ? dir : ".";
+	dump->name = name ? name : "moq-flight.bin";
+	bfree(dir);
+	bfree(name);
+
+	flight_recorder_dumped = recorder.Errors();
+	dump->snapshot = recorder.Snapshot(dump->count);
+	std::string file = dump->dir + "/" + dump->name;
+
+	if (wait) {
+		return save_flight_dump(*dump) ? file : "";
+	}
+
+	obs_queue_task(OBS_TASK_DESTROY, save_flight_dump_task, dump.release(), false);
+	return file;
+}
+
+// Adds one window of send rate, refusals and delivered video to the bandwidth test summary.
+void MoQOutput::SampleBandwidthTest(uint64_t now_us)
+{
+	if (!bandwidth.Due(now_us)) {
+		return;
+	}
+
+	if (!loopback.Subscribed() && loopback.Connected()) {
+		loopback.Subscribe(path);
+	}
+
+	uint64_t video_rate = video.stats.SendRate(now_us);
+	uint64_t rate = video_rate;
+	uint64_t sent = video.stats.objects_window.Sum(now_us);
+	uint64_t dropped = video.stats.drops_window.Sum(now_us);
+
+	for (const auto &track : audio) {
+		rate += track.stats.SendRate(now_us);
+		sent += track.stats.objects_window.Sum(now_us);
+		dropped += track.stats.drops_window.Sum(now_us);
+	}
+
+	bandwidth.Sample(now_us, rate, video_rate, loopback.Bytes(), sent, dropped);
+}
+
 void MoQOutput::AudioData(struct encoder_packet *packet)
 {
-	if (audio == 0) {
-		AudioInit();
+	if (packet->track_idx >= audio.size()) {
+		LOG_WARNING("Dropping audio frame for unknown track: %zu", packet->track_idx);
+		return;
+	}
+
+	MoQTrack &track = audio[packet->track_idx];
+	if (track.handle == 0) {
+		AudioInit(packet->track_idx, false);
 	}
 
-	if (audio < 0) {
+	if (track.handle < 0) {
 		// We failed to initialize the audio track, so we can't write any data.
 		return;
 	}
 
-	// Add ~1 second offset to handle negative PTS from audio priming frames.
-	// TODO: This is slightly wrong when den is not evenly divisible by num, but close enough.
-	int64_t pts = packet->pts + packet->timebase_den / packet->timebase_num;
-	if (pts < 0) {
-		LOG_WARNING("Dropping audio frame with negative PTS: %lld", (long long)packet->pts);
+	// Audio priming frames may start before the epoch; the timeline leaves headroom for them.
+	uint64_t pts_us;
+	if (!timestamps.Normalize(track.timeline, packet, pts_us)) {
+		LOG_WARNING("Dropping audio frame before the start of the timeline: %lld", (long long)packet->pts);
+		track.stats.Dropped(os_gettime_ns() / 1000, packet->size);
 		return;
 	}
 
-	auto pts_us = util_mul_div64(pts, 1000000ULL * packet->timebase_num, packet->timebase_den);
+	if (packet->encoder) {
+		RefreshTrackInfo(track, packet->encoder, false);
+	}
 
-	auto result = moq_publish_media_frame(audio, packet->data, packet->size, pts_us);
-	if (result < 0) {
-		LOG_ERROR("Failed to write audio frame: %d", result);
+	if (PastDeadline(track, packet, false)) {
+		track.stats.Expired(os_gettime_ns() / 1000, packet->size);
+		RecordEvent(MoQFlightEventType::Expired, &track, packet->size, false);
+		return;
+	}
+
+	if (track.aggregator.Enabled()) {
+		std::vector<MoQAudioObject> objects;
+		if (!track.aggregator.Push(packet->data, packet->size, pts_us, packet->sys_dts_usec, objects)) {
+			LOG_WARNING("Dropping invalid Opus packet (track %zu, %zu bytes)", packet->track_idx,
+				    packet->size);
+			track.stats.Dropped(os_gettime_ns() / 1000, packet->size);
+			return;
+		}
+
+		PublishAudioObjects(track, objects);
 		return;
 	}
 
-	total_bytes_sent += packet->size;
+	// Take a reference rather than copying the payload; it is released once libmoq is done with it.
+	auto result = PublishFrame(track, MoQPacket(packet), pts_us);
+	if (result < 0) {
+		LOG_ERROR("Failed to write audio frame (track %zu): %d", packet->track_idx, result);
+	}
 }
 
 void MoQOutput::VideoData(struct encoder_packet *packet)
 {
-	if (video == 0) {
-		VideoInit();
+	if (video.handle == 0) {
+		VideoInit(false, packet->keyframe ? packet : nullptr);
 	}
 
-	if (video < 0) {
+	// The encoder was reconfigured (e.g. a new output resolution). A keyframe is a group boundary, so
+	// close the track and publish a new one from here; libmoq updates the catalog and subscribers
+	// reconfigure their decoder when they switch to it.
+	if (video.handle > 0 && packet->keyframe && VideoConfigChanged(packet)) {
+		LOG_INFO("Video encoder configuration changed, rolling to a new track");
+		moq_publish_media_close(video.handle);
+		video.handle = 0;
+		video.reconfigurations++;
+		RecordEvent(MoQFlightEventType::TrackRoll, &video);
+		VideoInit(false, packet);
+	}
+
+	if (video.handle <= 0) {
+		if (video.handle == 0) {
+			// Still waiting for a keyframe to configure the track.
+			video.stats.Dropped(os_gettime_ns() / 1000, packet->size);
+		}
+		return;
+	}
+
+	uint64_t pts_us;
+	if (!timestamps.Normalize(video.timeline, packet, pts_us)) {
+		LOG_WARNING("Dropping video frame before the start of the timeline: %lld", (long long)packet->pts);
+		video.stats.Dropped(os_gettime_ns() / 1000, packet->size);
 		return;
 	}
 
-	// Add ~1 second offset to match audio for A/V sync.
-	// TODO: This is slightly wrong when den is not evenly divisible by num, but close enough.
-	int64_t pts = packet->pts + packet->timebase_den / packet->timebase_num;
-	if (pts < 0) {
-		LOG_WARNING("Dropping video frame with negative PTS: %lld", (long long)packet->pts);
+	// Encoder reconfiguration can only take effect on a keyframe, so that's where to look for it.
+	if (packet->keyframe && packet->encoder) {
+		RefreshTrackInfo(video, packet->encoder, false);
+	}
+
+	// Each encoder packet is one access unit and goes out as one frame. libmoq has no call to write a
+	// frame in pieces, and splitting an access unit across frames would hand subscribers partial
+	// samples. A relay still forwards a large frame as its bytes arrive on the stream.
+	if (PastDeadline(video, packet, true)) {
+		video.stats.Expired(os_gettime_ns() / 1000, packet->size);
+		RecordEvent(MoQFlightEventType::Expired, &video, packet->size, packet->keyframe);
 		return;
 	}
 
-	auto pts_us = util_mul_div64(pts, 1000000ULL * packet->timebase_num, packet->timebase_den);
+	// Samples rewritten or extended by the plugin count as a copy.
+	const uint8_t *data = packet->data;
+	size_t size = packet->size;
+	bool hevc = video.codec == "hev1" || video.codec == "hvc1";
+
+	if (video.length_prefixed) {
+		length_prefixed_buffer.clear();
+		if (!annexb_to_length_prefixed(packet->data, packet->size, hevc, length_prefixed_buffer)) {
+			LOG_WARNING("Dropping video frame without Annex-B start codes");
+			video.stats.Dropped(os_gettime_ns() / 1000, packet->size);
+			return;
+		}
+
+		data = length_prefixed_buffer.data();
+		size = length_prefixed_buffer.size();
+	}
+
+	if (capture_timestamps && packet->sys_dts_usec > 0) {
+		MoQBitstream format = video.codec == "av01"     ? MoQBitstream::AV1
+				      : video.length_prefixed ? MoQBitstream::LengthPrefixed
+							      : MoQBitstream::AnnexB;
+		int64_t unix_us = MoQTimestamps::ToUnixMicros(packet->sys_dts_usec);
+
+		// VP9 has no container for user data, so its frames go out unchanged.
+		bool supported = video.codec != "vp09";
+		if (supported && capture_time_insert(data, size, format, hevc, unix_us, capture_time_buffer)) {
+			data = capture_time_buffer.data();
+			size = capture_time_buffer.size();
+		} else if (capture_time_failures++ == 0) {
+			LOG_WARNING("Can't embed capture timestamps in %s frames", video.codec.c_str());
+		}
+	}
+
+	int result;
+	if (data != packet->data) {
+		copied_bytes += size;
+		result = PublishPayload(video, data, size, pts_us, packet->keyframe, packet->sys_dts_usec);
+	} else {
+		result = PublishFrame(video, MoQPacket(packet), pts_us);
+	}
 
-	auto result = moq_publish_media_frame(video, packet->data, packet->size, pts_us);
 	if (result < 0) {
 		LOG_ERROR("Failed to write video frame: %d", result);
-		return;
+		// Every later frame in the group depends on this one.
+		video.group_expired = true;
+	}
+}
+
+// Objects can't be recalled once libmoq has them, so the deadline is enforced here, before the handoff:
+// an object that reaches the publisher more than track.deadline_us after capture is dropped. Video frames
+// depend on the earlier frames of their group, so the rest of the group is skipped too (as it is after a
+// refused frame) and publishing resumes at the next keyframe. This also keeps stale video from queueing
+// ahead of audio and the newest group, since libmoq takes no send priorities. Audio frames are
+// independent and are dropped one by one.
+bool MoQOutput::PastDeadline(MoQTrack &track, const struct encoder_packet *packet, bool grouped)
+{
+	if (grouped) {
+		if (packet->keyframe) {
+			track.group_expired = false;
+		} else if (track.group_expired) {
+			return true;
+		}
 	}
 
-	total_bytes_sent += packet->size;
+	if (track.deadline_us == 0 || packet->sys_dts_usec <= 0 || replaying_preconnect) {
+		return false;
+	}
+
+	uint64_t now_us = os_gettime_ns() / 1000;
+	if ((uint64_t)packet->sys_dts_usec + track.deadline_us >= now_us) {
+		return false;
+	}
+
+	track.group_expired = grouped;
+	if (track.deadline_misses++ % 100 == 0) {
+		LOG_WARNING("Track %s: object %llu ms late, %s (%llu deadline misses)", track.name.c_str(),
+			    (unsigned long long)((now_us - packet->sys_dts_usec) / 1000),
+			    grouped ? "skipping to the next keyframe" : "dropped",
+			    (unsigned long long)track.deadline_misses);
+	}
+
+	return true;
 }
 
-void MoQOutput::VideoInit()
+// Takes ownership of the packet reference. libmoq copies the payload into its own buffer inside
+// moq_publish_media_frame, so the reference is released as soon as the call returns, whether the
+// frame was accepted or dropped.
+int MoQOutput::PublishFrame(MoQTrack &track, MoQPacket packet, uint64_t pts_us)
 {
-	obs_encoder_t *encoder = obs_output_get_video_encoder(output);
-	if (!encoder) {
-		LOG_ERROR("Failed to get video encoder");
+	return PublishPayload(track, packet.Data(), packet.Size(), pts_us, packet->keyframe, packet->sys_dts_usec);
+}
+
+// Publishes aggregated audio objects. Their payload was assembled by the plugin, so it counts as a copy.
+void MoQOutput::PublishAudioObjects(MoQTrack &track, std::vector<MoQAudioObject> &objects)
+{
+	for (const auto &object : objects) {
+		copied_bytes += object.payload.size();
+
+		auto result = PublishPayload(track, object.payload.data(), object.payload.size(), object.pts_us, false,
+					     object.sys_dts_usec);
+		if (result < 0) {
+			LOG_ERROR("Failed to write audio object (%s, %zu frames): %d", track.name.c_str(),
+				  object.frames, result);
+		}
+	}
+
+	objects.clear();
+}
+
+int MoQOutput::PublishPayload(MoQTrack &track, const uint8_t *data, size_t size, uint64_t pts_us, bool keyframe,
+			      int64_t sys_dts_usec)
+{
+	uint64_t now_us = os_gettime_ns() / 1000;
+	if (sys_dts_usec > 0 && (uint64_t)sys_dts_usec < now_us) {
+		track.stats.queue_delay_us.store(now_us - sys_dts_usec, std::memory_order_relaxed);
+	}
+
+	uint64_t call_ns = os_gettime_ns();
+	auto result = moq_publish_media_frame(track.handle, data, size, pts_us);
+	if (flight_recorder) {
+		uint64_t duration_ns = os_gettime_ns() - call_ns;
+		recorder.Record(MoQFlightEventType::Object, TrackIndex(track), call_ns / 1000,
+				duration_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_ns, size, keyframe, result);
+	}
+	if (result < 0) {
+		track.stats.Dropped(now_us, size);
+		return result;
+	}
+
+	track.stats.Sent(now_us, size, keyframe);
+	total_bytes_sent += size;
+	if (total_packets_sent++ == 0) {
+		auto elapsed = std::chrono::steady_clock::now() - start_time;
+		first_object_ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+		LOG_INFO("First object published %d ms after start", GetFirstObjectTime());
+	}
+	if (keyframe && &track == &video && first_keyframe_ms < 0) {
+		// Subscribers can't decode anything before this.
+		auto elapsed = std::chrono::steady_clock::now() - start_time;
+		first_keyframe_ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+		LOG_INFO("First keyframe published %d ms after start", first_keyframe_ms.load());
+	}
+
+	return result;
+}
+
+static void get_video_fps(const obs_encoder_t *encoder, uint32_t &fps_num, uint32_t &fps_den)
+{
+	video_t *video_output = obs_encoder_video(encoder);
+	const struct video_output_info *voi = video_output ? video_output_get_info(video_output) : nullptr;
+	if (voi) {
+		uint32_t divisor = obs_encoder_get_frame_rate_divisor(encoder);
+		fps_num = voi->fps_num;
+		fps_den = voi->fps_den * (divisor ? divisor : 1);
+	}
+}
+
+// Reads the encoder's bitrate, dimensions, frame rate and audio format into track.info and logs when
+// they change. Unless forced, the encoder is queried at most once per second.
+//
+// libmoq derives the broadcast catalog from the codec string and init data passed to
+// moq_publish_media_ordered (coded size from the SPS, sample rate and channels from the audio config),
+// and its C API has no fields for bitrate or frame rate. These values are kept here so they can be
+// polled through get_stats.
+void MoQOutput::RefreshTrackInfo(MoQTrack &track, const obs_encoder_t *encoder, bool force)
+{
+	uint64_t now_us = os_gettime_ns() / 1000;
+	if (!force && now_us - track.info.checked_us < 1000000) {
 		return;
 	}
+	track.info.checked_us = now_us;
 
-	// TODO Pass these along to the video catalog somehow.
-	/*
+	uint32_t bitrate = 0;
 	OBSDataAutoRelease settings = obs_encoder_get_settings(encoder);
-	if (!settings) {
-		LOG_ERROR("Failed to get video encoder settings");
+	if (settings) {
+		bitrate = (uint32_t)obs_data_get_int(settings, "bitrate");
+	}
+
+	uint32_t width = 0, height = 0, fps_num = 0, fps_den = 0, sample_rate = 0, channels = 0;
+
+	if (obs_encoder_get_type(encoder) == OBS_ENCODER_VIDEO) {
+		width = obs_encoder_get_width(encoder);
+		height = obs_encoder_get_height(encoder);
+		get_video_fps(encoder, fps_num, fps_den);
+	} else {
+		sample_rate = obs_encoder_get_sample_rate(encoder);
+
+		audio_t *audio_output = obs_encoder_audio(encoder);
+		if (audio_output) {
+			channels = (uint32_t)audio_output_get_channels(audio_output);
+		}
+	}
+
+	bool changed = track.info.bitrate_kbps.exchange(bitrate) != bitrate;
+	changed |= track.info.width.exchange(width) != width;
+	changed |= track.info.height.exchange(height) != height;
+	changed |= track.info.fps_num.exchange(fps_num) != fps_num;
+	changed |= track.info.fps_den.exchange(fps_den) != fps_den;
+	changed |= track.info.sample_rate.exchange(sample_rate) != sample_rate;
+	changed |= track.info.channels.exchange(channels) != channels;
+
+	if (!changed) {
 		return;
 	}
 
-	auto video_bitrate = (int)obs_data_get_int(settings, "bitrate");
-	auto video_width = obs_encoder_get_width(encoder);
-	auto video_height = obs_encoder_get_height(encoder);
-	*/
+	if (width > 0) {
+		LOG_INFO("Track %s: %ux%u @ %u/%u fps, %u kbps", track.name.c_str(), width, height, fps_num, fps_den,
+			 bitrate);
+	} else {
+		LOG_INFO("Track %s: %u Hz, %u channels, %u kbps", track.name.c_str(), sample_rate, channels, bitrate);
+	}
+}
+
+float MoQOutput::GetCongestion()
+{
+	// libmoq does not expose transport state, so use the share of objects dropped over the last second.
+	uint64_t now_us = os_gettime_ns() / 1000;
+	uint64_t sent = video.stats.objects_window.Sum(now_us);
+	uint64_t dropped = video.stats.drops_window.Sum(now_us);
+
+	for (const auto &track : audio) {
+		sent += track.stats.objects_window.Sum(now_us);
+		dropped += track.stats.drops_window.Sum(now_us);
+	}
+
+	if (sent + dropped == 0) {
+		return 0.0f;
+	}
+
+	return (float)dropped / (float)(sent + dropped);
+}
+
+int MoQOutput::GetDroppedFrames()
+{
+	return (int)video.stats.drops.load(std::memory_order_relaxed);
+}
+
+uint64_t MoQOutput::GetDroppedBytes()
+{
+	uint64_t bytes = video.stats.dropped_bytes.load(std::memory_order_relaxed);
+	for (const auto &track : audio) {
+		bytes += track.stats.dropped_bytes.load(std::memory_order_relaxed);
+	}
+
+	return bytes;
+}
+
+static void track_stats_to_data(obs_data_t *data, const MoQTrack &track, uint64_t now_us)
+{
+	obs_data_set_string(data, "name", track.name.c_str());
+	obs_data_set_int(data, "bytes", (long long)track.stats.bytes.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "objects", (long long)track.stats.objects.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "groups", (long long)track.stats.groups.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "keyframe_bytes", (long long)track.stats.keyframe_bytes.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "max_object_bytes",
+			 (long long)track.stats.max_object_bytes.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "drops", (long long)track.stats.drops.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "dropped_bytes", (long long)track.stats.dropped_bytes.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "expired", (long long)track.stats.expired.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "expired_bytes", (long long)track.stats.expired_bytes.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "send_rate_bps", (long long)track.stats.SendRate(now_us));
+	obs_data_set_int(data, "queue_delay_us", (long long)track.stats.queue_delay_us.load(std::memory_order_relaxed));
+
+	obs_data_set_int(data, "reconfigurations", (long long)track.reconfigurations.load(std::memory_order_relaxed));
+	obs_data_set_int(data, "bitrate_kbps", track.info.bitrate_kbps.load(std::memory_order_relaxed));
+	if (track.info.width > 0) {
+		obs_data_set_int(data, "width", track.info.width.load(std::memory_order_relaxed));
+		obs_data_set_int(data, "height", track.info.height.load(std::memory_order_relaxed));
+		obs_data_set_int(data, "fps_num", track.info.fps_num.load(std::memory_order_relaxed));
+		obs_data_set_int(data, "fps_den", track.info.fps_den.load(std::memory_order_relaxed));
+	}
+	if (track.info.sample_rate > 0) {
+		obs_data_set_int(data, "sample_rate", track.info.sample_rate.load(std::memory_order_relaxed));
+		obs_data_set_int(data, "channels", track.info.channels.load(std::memory_order_relaxed));
+	}
+}
+
+// Snapshot of the publish counters, exposed to scripts through the "get_stats" proc.
+// RTT is not reported because libmoq does not expose it.
+void MoQOutput::GetStats(obs_data_t *stats)
+{
+	uint64_t now_us = os_gettime_ns() / 1000;
+
+	obs_data_set_int(stats, "total_bytes", (long long)GetTotalBytes());
+	obs_data_set_int(stats, "total_objects", (long long)total_packets_sent.load(std::memory_order_relaxed));
+	obs_data_set_int(stats, "connect_time_ms", GetConnectTime());
+	obs_data_set_int(stats, "first_object_ms", GetFirstObjectTime());
+	obs_data_set_int(stats, "first_keyframe_ms", first_keyframe_ms.load(std::memory_order_relaxed));
+	obs_data_set_int(stats, "migrations", (long long)migrations.load(std::memory_order_relaxed));
+	obs_data_set_int(stats, "migration_ms", migration_ms.load(std::memory_order_relaxed));
+	obs_data_set_int(stats, "migration_handshake_ms", migration_handshake_ms.load(std::memory_order_relaxed));
+	obs_data_set_int(stats, "dropped_frames", GetDroppedFrames());
+	obs_data_set_double(stats, "congestion", GetCongestion());
+	obs_data_set_string(stats, "latency_profile", latency_profile.load(std::memory_order_relaxed));
+	if (direct_packets) {
+		obs_data_set_int(stats, "interleave_delay_us", (long long)interleave_delay.AverageUs());
+	}
+
+	if (preconnect_enabled) {
+		// Start-up loss: packets produced during the handshake that were trimmed instead of published.
+		uint64_t received = preconnect.received.load(std::memory_order_relaxed);
+		uint64_t trimmed = preconnect.trimmed.load(std::memory_order_relaxed);
+		OBSDataAutoRelease result = obs_data_create();
+		obs_data_set_int(result, "packets", (long long)received);
+		obs_data_set_int(result, "trimmed", (long long)trimmed);
+		obs_data_set_int(result, "trimmed_bytes",
+				 (long long)preconnect.trimmed_bytes.load(std::memory_order_relaxed));
+		obs_data_set_double(result, "loss", received ? (double)trimmed / (double)received : 0.0);
+		obs_data_set_obj(stats, "preconnect", result);
+	}
+
+	if (bwtest) {
+		OBSDataAutoRelease result = obs_data_create();
+		obs_data_set_int(result, "duration_sec", (long long)bandwidth.samples.load(std::memory_order_relaxed));
+		obs_data_set_int(result, "average_rate_bps", (long long)bandwidth.AverageRate());
+		obs_data_set_int(result, "delivered_rate_bps", (long long)bandwidth.AverageDeliveredRate());
+		obs_data_set_int(result, "min_delivered_rate_bps",
+				 (long long)bandwidth.min_delivered_bps.load(std::memory_order_relaxed));
+		obs_data_set_double(result, "delivery_ratio", bandwidth.DeliveryRatio());
+		obs_data_set_bool(result, "link_limited", bandwidth.LinkLimited());
+		obs_data_set_double(result, "loss", bandwidth.Loss());
+		obs_data_set_int(result, "recommended_bitrate_kbps", (long long)bandwidth.RecommendedKbps());
+		obs_data_set_obj(stats, "bwtest", result);
+	}
+
+	OBSDataArrayAutoRelease tracks = obs_data_array_create();
+
+	// Only report tracks that have seen traffic; the handles themselves belong to the output thread.
+	auto active = [](const MoQTrack &track) {
+		return track.stats.objects.load(std::memory_order_relaxed) > 0 ||
+		       track.stats.drops.load(std::memory_order_relaxed) > 0;
+	};
+
+	if (active(video)) {
+		OBSDataAutoRelease item = obs_data_create();
+		track_stats_to_data(item, video, now_us);
+		obs_data_array_push_back(tracks, item);
+	}
+
+	for (const auto &track : audio) {
+		if (!active(track)) {
+			continue;
+		}
+
+		OBSDataAutoRelease item = obs_data_create();
+		track_stats_to_data(item, track, now_us);
+		obs_data_array_push_back(tracks, item);
+	}
+
+	obs_data_set_array(stats, "tracks", tracks);
+}
+
+// Builds the av1C or vpcC record for AV1 and VP9. AV1 encoders repeat the sequence header on keyframes,
+// so a keyframe is preferred over the extra data, which may predate a reconfiguration. VP9 has no extra
+// data; the record comes from the keyframe's uncompressed header.
+static bool parse_record_config(const char *codec, obs_encoder_t *encoder, const uint8_t *extra_data,
+				size_t extra_size, const struct encoder_packet *keyframe, MoQCodecConfig &config)
+{
+	if (strcmp(codec, "av1") == 0) {
+		if (keyframe && parse_av1_config(keyframe->data, keyframe->size, config)) {
+			return true;
+		}
+		return extra_size > 0 && parse_av1_config(extra_data, extra_size, config);
+	}
+
+	if (strcmp(codec, "vp9") == 0 && keyframe) {
+		uint32_t fps_num = 0, fps_den = 0;
+		get_video_fps(encoder, fps_num, fps_den);
+		return parse_vp9_config(keyframe->data, keyframe->size, fps_num, fps_den, config);
+	}
+
+	return false;
+}
+
+// Checked on every keyframe: whether the encoder's codec configuration (extra data, coded size, or the
+// AV1/VP9 record carried by the keyframe) differs from what the video track was created with.
+bool MoQOutput::VideoConfigChanged(const struct encoder_packet *keyframe)
+{
+	obs_encoder_t *encoder = obs_output_get_video_encoder(output);
+	if (!encoder) {
+		return false;
+	}
+
+	if (obs_encoder_get_width(encoder) != video.init_width ||
+	    obs_encoder_get_height(encoder) != video.init_height) {
+		return true;
+	}
+
+	uint8_t *extra_data = nullptr;
+	size_t extra_size = 0;
+	obs_encoder_get_extra_data(encoder, &extra_data, &extra_size);
+
+	const char *codec = obs_encoder_get_codec(encoder);
+	if (strcmp(codec, "av1") == 0 || strcmp(codec, "vp9") == 0) {
+		MoQCodecConfig config;
+		if (!parse_record_config(codec, encoder, extra_data, extra_size, keyframe, config)) {
+			return false;
+		}
+		return config.record != video.init;
+	}
+
+	// An avc3/hev1 track created before the encoder had extra data relied on the in-band parameter
+	// sets; adopt the extra data once it shows up rather than treating it as a change.
+	if (video.init.empty()) {
+		video.init.assign(extra_data, extra_data + extra_size);
+		return false;
+	}
+
+	return video.init.size() != extra_size || !std::equal(video.init.begin(), video.init.end(), extra_data);
+}
+
+// With at_start set, the track is only created if libmoq can be given its codec config now: either the
+// encoder already has extradata, or the codec carries its parameter sets in-band (avc3/hev1), in which
+// case libmoq picks them up from the first keyframe. Otherwise creation is left to the first packet.
+// For AV1 and VP9, the configuration record can also be built from that first keyframe.
+void MoQOutput::VideoInit(bool at_start, const struct encoder_packet *keyframe)
+{
+	obs_encoder_t *encoder = obs_output_get_video_encoder(output);
+	if (!encoder) {
+		LOG_ERROR("Failed to get video encoder");
+		return;
+	}
 
 	uint8_t *extra_data = nullptr;
 	size_t extra_size = 0;
 
 	// obs_encoder_get_extra_data may only return data after the first frame has been encoded.
 	// For H.264, this returns the SPS/PPS
-	if (!obs_encoder_get_extra_data(encoder, &extra_data, &extra_size)) {
+	if (!obs_encoder_get_extra_data(encoder, &extra_data, &extra_size) && !at_start) {
 		LOG_WARNING("Failed to get extra data");
 	}
 
@@ -238,74 +1292,170 @@ void MoQOutput::VideoInit()
 
 	// Transform codec string for MoQ
 	const char *moq_codec = codec;
+	const uint8_t *init_data = extra_data;
+	size_t init_size = extra_size;
+	bool in_band_config = false;
+	bool needs_record = false;
+	MoQCodecConfig config;
+
 	if (strcmp(codec, "h264") == 0) {
 		// H.264 with inline SPS/PPS
 		moq_codec = "avc3";
+		in_band_config = true;
 	} else if (strcmp(codec, "hevc") == 0) {
 		// H.265 with inline VPS/SPS/PPS
 		moq_codec = "hev1";
+		in_band_config = true;
+	} else if (strcmp(codec, "av1") == 0) {
+		// AV1, configured with an av1C record built from the sequence header OBU.
+		moq_codec = "av01";
+		needs_record = true;
+		parse_record_config(codec, encoder, extra_data, extra_size, keyframe, config);
+	} else if (strcmp(codec, "vp9") == 0) {
+		// VP9, configured with a vpcC record built from the keyframe's uncompressed header.
+		moq_codec = "vp09";
+		needs_record = true;
+		parse_record_config(codec, encoder, extra_data, extra_size, keyframe, config);
+	}
+
+	if (needs_record) {
+		if (config.record.empty()) {
+			if (keyframe) {
+				LOG_ERROR("Failed to parse %s codec configuration from keyframe", codec);
+				video.handle = -1;
+			} else if (at_start) {
+				LOG_INFO("Video codec configuration not available yet, creating track on the first keyframe");
+			}
+			return;
+		}
+
+		init_data = config.record.data();
+		init_size = config.record.size();
+		LOG_INFO("Video codec: %s (%ux%u)", config.codec.c_str(), config.width, config.height);
+	} else if (at_start && extra_size == 0 && !in_band_config) {
+		LOG_INFO("Video extra data not available yet, creating track on the first packet");
+		return;
+	}
+
+	// Optionally publish H.264/HEVC as avc1/hvc1: length-prefixed samples, with the parameter sets only
+	// in the avcC/hvcC record built from the encoder's extra data.
+	uint8_t *record = nullptr;
+	size_t record_size = 0;
+	video.length_prefixed = false;
+
+	if (in_band_config && length_prefixed) {
+		if (extra_size == 0) {
+			if (at_start) {
+				LOG_INFO("Video extra data not available yet, creating track on the first packet");
+				return;
+			}
+		} else {
+			bool hevc = strcmp(codec, "hevc") == 0;
+			record_size = hevc ? obs_parse_hevc_header(&record, extra_data, extra_size)
+					   : obs_parse_avc_header(&record, extra_data, extra_size);
+		}
+
+		if (record_size > 0) {
+			const char *prefixed_codec = strcmp(codec, "hevc") == 0 ? "hvc1" : "avc1";
+			video.handle = moq_publish_media_ordered(broadcast, prefixed_codec, strlen(prefixed_codec),
+								 record, record_size);
+			if (video.handle > 0) {
+				video.length_prefixed = true;
+				moq_codec = prefixed_codec;
+			} else {
+				LOG_WARNING("Failed to publish %s track (%d), falling back to %s", prefixed_codec,
+					    video.handle, moq_codec);
+			}
+		} else {
+			LOG_WARNING("Failed to build a configuration record from the extra data, publishing %s",
+				    moq_codec);
+		}
+
+		bfree(record);
 	}
 
 	// Intialize the media import module with the codec and initialization data.
-	video = moq_publish_media_ordered(broadcast, moq_codec, strlen(moq_codec), extra_data, extra_size);
-	if (video < 0) {
-		LOG_ERROR("Failed to initialize video track: %d", video);
+	if (!video.length_prefixed) {
+		video.handle = moq_publish_media_ordered(broadcast, moq_codec, strlen(moq_codec), init_data,
+							 init_size);
+	}
+	if (video.handle < 0) {
+		LOG_ERROR("Failed to initialize video track: %d", video.handle);
 		return;
 	}
 
-	LOG_INFO("Video track initialized successfully");
+	// Remember what the track was created from, to notice when the encoder is reconfigured.
+	video.codec = moq_codec;
+	video.init.assign(init_data, init_data + init_size);
+	video.init_width = obs_encoder_get_width(encoder);
+	video.init_height = obs_encoder_get_height(encoder);
+
+	LOG_INFO("Video track initialized successfully (%s)", moq_codec);
+	RefreshTrackInfo(video, encoder, true);
 }
 
-void MoQOutput::AudioInit()
+void MoQOutput::AudioInit(size_t track_idx, bool at_start)
 {
-	obs_encoder_t *encoder = obs_output_get_audio_encoder(output, 0);
-	if (!encoder) {
-		LOG_ERROR("Failed to get audio encoder");
-		return;
-	}
+	MoQTrack &track = audio[track_idx];
 
-	// TODO Pass these along to the audio catalog somehow.
-	/*
-	OBSDataAutoRelease settings = obs_encoder_get_settings(encoder);
-	if (!settings) {
-		LOG_ERROR("Failed to get audio encoder settings");
+	obs_encoder_t *encoder = obs_output_get_audio_encoder(output, track_idx);
+	if (!encoder) {
+		LOG_ERROR("Failed to get audio encoder %zu", track_idx);
+		track.handle = -1;
 		return;
 	}
 
-	auto audio_bitrate = (int)obs_data_get_int(settings, "bitrate");
-	*/
-
 	uint8_t *extra_data = nullptr;
 	size_t extra_size = 0;
 
 	// obs_encoder_get_extra_data may only return data after the first frame has been encoded.
 	// For AAC, this returns 2 bytes containing the profile and the sample rate.
-	if (!obs_encoder_get_extra_data(encoder, &extra_data, &extra_size)) {
+	if (!obs_encoder_get_extra_data(encoder, &extra_data, &extra_size) && !at_start) {
 		LOG_WARNING("Failed to get extra data");
 	}
 
 	const char *codec = obs_encoder_get_codec(encoder);
 
-	audio = moq_publish_media_ordered(broadcast, codec, strlen(codec), extra_data, extra_size);
-	if (audio < 0) {
-		LOG_ERROR("Failed to initialize audio track: %d", audio);
+	// Audio config is never carried in-band, so wait for the first packet rather than publish without it.
+	if (at_start && extra_size == 0) {
+		LOG_INFO("Audio track %zu extra data not available yet, creating track on the first packet", track_idx);
+		return;
+	}
+
+	// Each encoder becomes its own track in the catalog, so subscribers can pick a single mix.
+	track.handle = moq_publish_media_ordered(broadcast, codec, strlen(codec), extra_data, extra_size);
+	if (track.handle < 0) {
+		LOG_ERROR("Failed to initialize audio track %zu: %d", track_idx, track.handle);
 		return;
 	}
 
-	LOG_INFO("Audio track initialized successfully");
+	track.codec = codec;
+	LOG_INFO("Audio track %zu initialized successfully (mixer %zu, %s)", track_idx,
+		 obs_encoder_get_mixer_index(encoder) + 1, codec);
+
+	// Only Opus can carry several frames in one self-describing packet. AAC has no such framing
+	// without ADTS or LATM, which the raw AAC track doesn't use, so it stays one frame per object.
+	if (strcmp(codec, "opus") == 0) {
+		track.aggregator.Configure(audio_frames_per_object, audio_aggregation_max_us);
+	}
+
+	RefreshTrackInfo(track, encoder, true);
 }
 
 void register_moq_output()
 {
+	MoQDirectFeed::Register();
+
 	const uint32_t base_flags = OBS_OUTPUT_ENCODED | OBS_OUTPUT_SERVICE;
+	// Every audio encoder attached to the output (up to one per OBS mixer) is published as its own track.
+	const uint32_t audio_flags = OBS_OUTPUT_AUDIO | OBS_OUTPUT_MULTI_TRACK;
 
 	const char *audio_codecs = "aac;opus";
-	// TODO: Add support for AV1, VP9.
-	const char *video_codecs = "h264;hevc";
+	const char *video_codecs = "h264;hevc;av1;vp9";
 
 	struct obs_output_info info = {};
 	info.id = "moq_output";
-	info.flags = OBS_OUTPUT_AV | base_flags;
+	info.flags = OBS_OUTPUT_VIDEO | audio_flags | base_flags;
 	info.get_name = [](void *) -> const char * {
 		return "MoQ Output";
 	};
@@ -318,18 +1468,24 @@ void register_moq_output()
 	info.start = [](void *priv_data) -> bool {
 		return static_cast<MoQOutput *>(priv_data)->Start();
 	};
-	info.stop = [](void *priv_data, uint64_t) {
-		static_cast<MoQOutput *>(priv_data)->Stop();
+	info.stop = [](void *priv_data, uint64_t ts) {
+		static_cast<MoQOutput *>(priv_data)->RequestStop(ts);
 	};
 	info.encoded_packet = [](void *priv_data, struct encoder_packet *packet) {
 		static_cast<MoQOutput *>(priv_data)->Data(packet);
 	};
 	info.get_total_bytes = [](void *priv_data) -> uint64_t {
-		return (uint64_t)static_cast<MoQOutput *>(priv_data)->GetTotalBytes();
+		return static_cast<MoQOutput *>(priv_data)->GetTotalBytes();
 	};
 	info.get_connect_time_ms = [](void *priv_data) -> int {
 		return static_cast<MoQOutput *>(priv_data)->GetConnectTime();
 	};
+	info.get_congestion = [](void *priv_data) -> float {
+		return static_cast<MoQOutput *>(priv_data)->GetCongestion();
+	};
+	info.get_dropped_frames = [](void *priv_data) -> int {
+		return static_cast<MoQOutput *>(priv_data)->GetDroppedFrames();
+	};
 	info.encoded_video_codecs = video_codecs;
 	info.encoded_audio_codecs = audio_codecs;
 	info.protocols = "MoQ";
@@ -342,7 +1498,7 @@ void register_moq_output()
 	obs_register_output(&info);
 
 	info.id = "moq_output_audio";
-	info.flags = OBS_OUTPUT_AUDIO | base_flags;
+	info.flags = audio_flags | base_flags;
 	info.encoded_video_codecs = nullptr;
 	info.encoded_audio_codecs = audio_codecs;
 	obs_register_output(&info);
@@ -1,9 +1,51 @@
 #pragma once
 #include <obs-module.h>
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 #include "logger.h"
+#include "moq-aggregate.h"
+#include "moq-direct.h"
+#include "moq-loopback.h"
+#include "moq-packet.h"
+#include "moq-preconnect.h"
+#include "moq-recorder.h"
+#include "moq-session.h"
+#include "moq-stats.h"
+#include "moq-timestamp.h"
+
+// State for one published MoQ track.
+struct MoQTrack {
+    // Fixed name used in logs and stats: "video", "audio0", "audio1", ...
+    std::string name;
+    // libmoq media handle: 0 = not created yet, < 0 = failed to create.
+    int handle = 0;
+    MoQTrackStats stats;
+    MoQTrackInfo info;
+    MoQTrackTimeline timeline;
+    // Codec string the track was published with, e.g. "avc3" or "opus".
+    std::string codec;
+    // Init data the track was created with, and (video) the coded size at that time.
+    std::vector<uint8_t> init;
+    uint32_t init_width = 0;
+    uint32_t init_height = 0;
+    // Video only: samples are rewritten from Annex-B to length-prefixed (avc1/hvc1).
+    bool length_prefixed = false;
+    // Times the track was replaced after an encoder reconfiguration.
+    std::atomic<uint64_t> reconfigurations{0};
+    // Opus audio tracks only; disabled unless configured.
+    MoQAudioAggregator aggregator;
+    // Longest time from capture to handing an object to libmoq; 0 = no deadline.
+    uint64_t deadline_us = 0;
+    uint64_t deadline_misses = 0;
+    // Video only: the current group can no longer be delivered, so skip to the next keyframe.
+    bool group_expired = false;
+};
 
 class MoQOutput
 {
@@ -12,39 +54,143 @@ class MoQOutput
     ~MoQOutput();
 
     bool Start();
+    void RequestStop(uint64_t ts);
     void Stop(bool signal = true);
     void Data(struct encoder_packet *packet);
 
-    inline size_t GetTotalBytes()
+    inline uint64_t GetTotalBytes()
     {
-        return total_bytes_sent;
+        return total_bytes_sent.load(std::memory_order_relaxed);
     }
 
     inline int GetConnectTime()
     {
-        return connect_time_ms;
+        return connect_time_ms.load(std::memory_order_relaxed);
+    }
+
+    // Time from Start() until the first object was handed to libmoq, or -1 if none yet.
+    inline int GetFirstObjectTime()
+    {
+        return first_object_ms.load(std::memory_order_relaxed);
     }
 
+    float GetCongestion();
+    int GetDroppedFrames();
+    uint64_t GetDroppedBytes();
+    void GetStats(obs_data_t *stats);
+    // Writes a flight recorder dump and returns its path. Unless wait is set the file is written on OBS's
+    // destroy task thread, so the packet path never blocks on disk.
+    std::string DumpFlightRecorder(const char *reason, bool wait = false);
+    // Moves publishing to another relay without stopping; carried out by the output thread.
+    bool Migrate(const std::string &url);
+
       private:
-    void VideoInit();
+    void DirectData(struct encoder_packet *packet);
+    void Publish(struct encoder_packet *packet);
+    void Dispatch(struct encoder_packet *packet);
+    void ReleasePreconnect();
+    void VideoInit(bool at_start, const struct encoder_packet *keyframe);
     void VideoData(struct encoder_packet *packet);
-    void AudioInit();
+    bool VideoConfigChanged(const struct encoder_packet *keyframe);
+    bool PastDeadline(MoQTrack &track, const struct encoder_packet *packet, bool grouped);
+    void AudioInit(size_t track_idx, bool at_start);
     void AudioData(struct encoder_packet *packet);
+    int PublishFrame(MoQTrack &track, MoQPacket packet, uint64_t pts_us);
+    int PublishPayload(MoQTrack &track, const uint8_t *data, size_t size, uint64_t pts_us, bool keyframe,
+                       int64_t sys_dts_usec);
+    void PublishAudioObjects(MoQTrack &track, std::vector<MoQAudioObject> &objects);
+    void RefreshTrackInfo(MoQTrack &track, const obs_encoder_t *encoder, bool force);
+    void SampleBandwidthTest(uint64_t now_us);
+    uint8_t TrackIndex(const MoQTrack &track) const;
+    void RecordEvent(MoQFlightEventType type, const MoQTrack *track, size_t size = 0, bool keyframe = false,
+                     int32_t result = 0);
+    void StepMigration(const struct encoder_packet *packet);
 
     obs_output_t *output;
 
     std::string server_url;
     std::string path;
 
-    size_t total_bytes_sent;
-    int connect_time_ms;
-    std::chrono::steady_clock::time_point connect_start;
+    // Written by the output thread, read by the UI thread and scripts.
+    std::atomic<uint64_t> total_bytes_sent;
+    std::atomic<uint64_t> total_packets_sent;
+    // Payload bytes the plugin had to memcpy before handing a packet to libmoq.
+    std::atomic<uint64_t> copied_bytes;
+    std::atomic<int> connect_time_ms;
+    std::atomic<int> first_object_ms;
+    // Time from Start() until the first video keyframe was handed to libmoq, or -1 if none yet.
+    std::atomic<int> first_keyframe_ms;
+    // Handshake time is read from the session on the output thread, since it may be shared.
+    uint64_t connect_start_us;
+    bool connect_pending;
+    // Packets produced while connect_pending, and whether they are being published now.
+    bool preconnect_enabled;
+    MoQPreconnectBuffer preconnect;
+    bool replaying_preconnect;
+
+    // Graceful stop: capture time (us) from which packets are no longer published, 0 while running.
+    std::atomic<uint64_t> stop_ts_us;
+    uint64_t stop_deadline_us;
+    // How long a stop may wait for queued frames, and how long libmoq then gets to send them.
+    uint64_t stop_flush_us;
+    uint64_t stop_bytes_base;
+    uint64_t stop_dropped_base;
+    std::chrono::steady_clock::time_point start_time;
+    // Latency profile the service applied to the encoders; always points at a string literal.
+    std::atomic<const char *> latency_profile;
+
+    // Shared publish timeline for all tracks.
+    MoQTimestamps timestamps;
 
-    int origin;
-    int session;
+    // Bandwidth test mode: the stream goes to a throwaway path and only the measured throughput matters.
+    bool bwtest;
+    MoQBandwidthTest bandwidth;
+    MoQLoopback loopback;
+
+    // Publish H.264/HEVC as avc1/hvc1 rather than avc3/hev1, and the buffer samples are rewritten into.
+    bool length_prefixed;
+    std::vector<uint8_t> length_prefixed_buffer;
+
+    // Publish packets as the encoders produce them rather than after OBS's interleaver, and how much
+    // delay that saves.
+    bool direct_packets;
+    MoQDirectFeed direct;
+    MoQInterleaveDelay interleave_delay;
+
+    // Recent publish events, dumped to a file on errors, session loss and on request.
+    bool flight_recorder;
+    MoQFlightRecorder recorder;
+    // Errors already covered by a dump, so each incident is dumped once.
+    std::atomic<uint64_t> flight_recorder_dumped;
+    bool session_lost;
+
+    // Embed each video frame's capture time (SEI or metadata OBU) for latency measurement.
+    bool capture_timestamps;
+    std::vector<uint8_t> capture_time_buffer;
+    uint64_t capture_time_failures;
+
+
+    // Opus frames per audio object (1 = one object per packet) and the latency that may add.
+    size_t audio_frames_per_object;
+    uint64_t audio_aggregation_max_us;
+
+    std::shared_ptr<MoQSession> session;
     int broadcast;
-    int video;
-    int audio;
+
+    // Relay migration. At the first video keyframe after the new session connected, the current broadcast
+    // is closed and a new one is published on the new session, so each relay's stream ends or starts at a
+    // group boundary. migration_url is set by Migrate() and taken by the output thread.
+    std::mutex migration_mutex;
+    std::string migration_url;
+    std::shared_ptr<MoQSession> migrating;
+    uint64_t migration_start_us;
+    std::atomic<uint64_t> migrations;
+    // Last migration: request to switch, and the new session's handshake; -1 if none yet.
+    std::atomic<int> migration_ms;
+    std::atomic<int> migration_handshake_ms;
+    MoQTrack video;
+    // One MoQ track per OBS audio encoder, indexed by encoder_packet::track_idx.
+    std::array<MoQTrack, MAX_OUTPUT_AUDIO_ENCODERS> audio;
 };
 
 void register_moq_output();
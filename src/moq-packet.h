@@ -0,0 +1,85 @@
+#pragma once
+#include <obs-module.h>
+
+#include <utility>
+
+// Owning handle to an encoder packet.
+//
+// The payload is shared with the encoder through obs_encoder_packet_ref instead of being copied,
+// so a packet can be handed to the publish path (or held in a queue) without a memcpy.
+// The reference is dropped with obs_encoder_packet_release when the handle is released or destroyed.
+class MoQPacket
+{
+      public:
+    MoQPacket() : packet() {}
+
+    explicit MoQPacket(struct encoder_packet *src) : packet()
+    {
+        obs_encoder_packet_ref(&packet, src);
+    }
+
+    MoQPacket(MoQPacket &&other) noexcept : packet(other.packet)
+    {
+        other.packet = {};
+    }
+
+    MoQPacket &operator=(MoQPacket &&other) noexcept
+    {
+        if (this != &other) {
+            Release();
+            packet = other.packet;
+            other.packet = {};
+        }
+        return *this;
+    }
+
+    MoQPacket(const MoQPacket &) = delete;
+    MoQPacket &operator=(const MoQPacket &) = delete;
+
+    ~MoQPacket()
+    {
+        Release();
+    }
+
+    // Give the payload back to the encoder. Safe to call more than once.
+    void Release()
+    {
+        if (packet.data) {
+            obs_encoder_packet_release(&packet);
+        }
+        packet = {};
+    }
+
+    explicit operator bool() const
+    {
+        return packet.data != nullptr;
+    }
+
+    struct encoder_packet *operator->()
+    {
+        return &packet;
+    }
+
+    const struct encoder_packet *operator->() const
+    {
+        return &packet;
+    }
+
+    struct encoder_packet *Get()
+    {
+        return &packet;
+    }
+
+    const uint8_t *Data() const
+    {
+        return packet.data;
+    }
+
+    size_t Size() const
+    {
+        return packet.size;
+    }
+
+      private:
+    struct encoder_packet packet;
+};
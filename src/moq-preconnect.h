@@ -0,0 +1,102 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+#include "moq-packet.h"
+
+// Holds packets produced while the session handshake is still in flight, so the first group isn't handed
+// to libmoq before there is anywhere to send it.
+//
+// Only the newest group is kept: a video keyframe drops every buffered video packet and the audio
+// captured before it, and video before the first keyframe is dropped outright, since nothing could decode
+// it. When the session comes up, the buffer starts on a keyframe with audio from the same moment.
+// Outputs without video keep the last AUDIO_ONLY_US of audio.
+class MoQPreconnectBuffer
+{
+      public:
+    static constexpr int64_t AUDIO_ONLY_US = 1000000;
+
+    void Reset(bool has_video)
+    {
+        this->has_video = has_video;
+        packets.clear();
+        keyframe = false;
+        received = 0;
+        trimmed = 0;
+        trimmed_bytes = 0;
+    }
+
+    bool Empty() const
+    {
+        return packets.empty();
+    }
+
+    // Takes a reference to the packet.
+    void Push(struct encoder_packet *packet)
+    {
+        bool video = packet->type == OBS_ENCODER_VIDEO;
+        received++;
+
+        if (video && packet->keyframe) {
+            Trim(packet->sys_dts_usec, true);
+            keyframe = true;
+        } else if (video && !keyframe) {
+            Count(packet->size);
+            return;
+        } else if (!has_video) {
+            Trim(packet->sys_dts_usec - AUDIO_ONLY_US, false);
+        }
+
+        packets.emplace_back(packet);
+    }
+
+    // Drops everything still buffered, e.g. when the output stops before the session came up.
+    void Discard()
+    {
+        for (const MoQPacket &packet : packets) {
+            Count(packet.Size());
+        }
+        packets.clear();
+    }
+
+    // Removes and returns the oldest packet.
+    MoQPacket Pop()
+    {
+        MoQPacket packet = std::move(packets.front());
+        packets.pop_front();
+        return packet;
+    }
+
+    // Packets that arrived while connecting, and those trimmed rather than published. Read by the stats.
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> trimmed{0};
+    std::atomic<uint64_t> trimmed_bytes{0};
+
+      private:
+    // Drops audio captured before sys_dts_usec, and with all_video set every video packet.
+    void Trim(int64_t sys_dts_usec, bool all_video)
+    {
+        for (auto it = packets.begin(); it != packets.end();) {
+            bool video = (*it)->type == OBS_ENCODER_VIDEO;
+            if (video ? all_video : (*it)->sys_dts_usec < sys_dts_usec) {
+                Count((*it)->size);
+                it = packets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void Count(size_t size)
+    {
+        trimmed++;
+        trimmed_bytes += size;
+    }
+
+    bool has_video = false;
+    // Whether a keyframe has been buffered; the buffered video then always starts with one.
+    bool keyframe = false;
+    std::deque<MoQPacket> packets;
+};
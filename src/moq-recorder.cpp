@@ -0,0 +1,128 @@
+#include "moq-recorder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "moq-timestamp.h"
+#include "util/platform.h"
+
+static const char MAGIC[8] = {'M', 'O', 'Q', 'F', 'L', 'T', '0', '1'};
+static constexpr size_t EVENT_SIZE = 32;
+
+void MoQFlightRecorder::Record(MoQFlightEventType type, uint8_t track, uint64_t time_us, uint32_t duration_ns,
+			       size_t size, bool keyframe, int32_t result)
+{
+	uint64_t seq = next.fetch_add(1, std::memory_order_relaxed) + 1;
+	Event &event = events[(seq - 1) % CAPACITY];
+
+	event.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	event.time_us = time_us;
+	event.duration_ns = duration_ns;
+	event.size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+	event.result = result;
+	event.type = (uint8_t)type;
+	event.track = track;
+	event.keyframe = keyframe;
+
+	event.seq.store(seq, std::memory_order_release);
+
+	if (result < 0 || type == MoQFlightEventType::SessionClosed || type == MoQFlightEventType::EncoderError) {
+		errors.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+template<typename T> static void put(std::vector<uint8_t> &out, T value)
+{
+	for (size_t i = 0; i < sizeof(T); i++) {
+		out.push_back((uint8_t)((uint64_t)value >> (8 * i)));
+	}
+}
+
+std::vector<uint8_t> MoQFlightRecorder::Snapshot(uint64_t &count) const
+{
+	uint64_t last = next.load(std::memory_order_acquire);
+	uint64_t first = last > CAPACITY ? last - CAPACITY + 1 : 1;
+
+	std::vector<uint8_t> body;
+	body.reserve(CAPACITY * EVENT_SIZE);
+	count = 0;
+
+	for (uint64_t seq = first; seq <= last; seq++) {
+		const Event &event = events[(seq - 1) % CAPACITY];
+		if (event.seq.load(std::memory_order_acquire) != seq) {
+			continue;
+		}
+
+		uint64_t time_us = event.time_us;
+		uint32_t duration_ns = event.duration_ns;
+		uint32_t size = event.size;
+		int32_t result = event.result;
+		uint8_t type = event.type;
+		uint8_t track = event.track;
+		uint8_t keyframe = event.keyframe;
+
+		// Overwritten while it was being copied.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (event.seq.load(std::memory_order_relaxed) != seq) {
+			continue;
+		}
+
+		put(body, seq);
+		put(body, time_us);
+		put(body, duration_ns);
+		put(body, size);
+		put(body, (uint32_t)result);
+		put(body, type);
+		put(body, track);
+		put(body, keyframe);
+		put(body, (uint8_t)0);
+		count++;
+	}
+
+	std::vector<uint8_t> snapshot(MAGIC, MAGIC + sizeof(MAGIC));
+	snapshot.reserve(snapshot.size() + 24 + body.size());
+	put(snapshot, (uint32_t)EVENT_SIZE);
+	put(snapshot, (uint32_t)0);
+	put(snapshot, count);
+	put(snapshot, (uint64_t)MoQTimestamps::ToUnixMicros(0));
+	snapshot.insert(snapshot.end(), body.begin(), body.end());
+	return snapshot;
+}
+
+bool MoQFlightRecorder::Save(const std::string &dir, const std::string &name, const std::vector<uint8_t> &snapshot)
+{
+	os_mkdirs(dir.c_str());
+
+	std::string path = dir + "/" + name;
+	FILE *file = os_fopen(path.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+
+	bool ok = fwrite(snapshot.data(), 1, snapshot.size(), file) == snapshot.size();
+	ok = fclose(file) == 0 && ok;
+
+	// The names carry the date and time, so they sort oldest first.
+	std::vector<std::string> dumps;
+	if (os_dir_t *listing = os_opendir(dir.c_str())) {
+		while (struct os_dirent *entry = os_readdir(listing)) {
+			size_t length = strlen(entry->d_name);
+			if (!entry->directory && strncmp(entry->d_name, "moq-flight-", 11) == 0 && length > 4 &&
+			    strcmp(entry->d_name + length - 4, ".bin") == 0) {
+				dumps.push_back(entry->d_name);
+			}
+		}
+		os_closedir(listing);
+	}
+
+	std::sort(dumps.begin(), dumps.end());
+	for (size_t i = 0; i + MAX_DUMPS < dumps.size(); i++) {
+		os_unlink((dir + "/" + dumps[i]).c_str());
+	}
+
+	return ok;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class MoQFlightEventType : uint8_t {
+    Start = 1,
+    // An object handed to libmoq; result < 0 if it was refused.
+    Object = 2,
+    // An object skipped because it missed its deadline.
+    Expired = 3,
+    SessionConnected = 4,
+    SessionClosed = 5,
+    // The video track was replaced after an encoder reconfiguration.
+    TrackRoll = 6,
+    EncoderError = 7,
+    Stop = 8,
+    // Publishing moved to another relay; result is the switch time in ms.
+    Migrated = 9,
+};
+
+// Ring of the most recent publish events, dumped to a file when something goes wrong so a freeze or drop
+// can be reconstructed afterwards (tools/moq-flight.py renders the dump).
+//
+// Recording takes one atomic increment and a few plain stores, without locks, so the output thread and
+// libmoq callbacks can record concurrently. Each slot's sequence number is written last; a dump running
+// at the same time skips slots that are mid-write.
+//
+// Dump format, little-endian: the 8-byte magic "MOQFLT01", u32 event size (32), u32 reserved, u64 event
+// count, i64 offset from the monotonic clock (os_gettime_ns() / 1000) to Unix time in microseconds, then
+// the events oldest first, each laid out as Event without its atomic.
+class MoQFlightRecorder
+{
+      public:
+    static constexpr size_t CAPACITY = 8192;
+    // Dumps kept in a directory; older ones are deleted when a new one is saved.
+    static constexpr size_t MAX_DUMPS = 10;
+
+    struct Event {
+        // 1-based position in the recording; 0 while never written or being rewritten.
+        std::atomic<uint64_t> seq{0};
+        // Monotonic clock, as os_gettime_ns() / 1000.
+        uint64_t time_us = 0;
+        // Time spent in the libmoq publish call.
+        uint32_t duration_ns = 0;
+        uint32_t size = 0;
+        int32_t result = 0;
+        uint8_t type = 0;
+        // 0 for video, 1 + n for audio track n.
+        uint8_t track = 0;
+        uint8_t keyframe = 0;
+        uint8_t reserved = 0;
+    };
+
+    void Record(MoQFlightEventType type, uint8_t track, uint64_t time_us, uint32_t duration_ns, size_t size,
+                bool keyframe, int32_t result);
+
+    // Number of refused objects, session losses and encoder errors recorded so far.
+    uint64_t Errors() const
+    {
+        return errors.load(std::memory_order_relaxed);
+    }
+
+    // Copies the recorded events into the contents of a dump file and sets count to the number of events
+    // copied. Only touches memory, so it is safe on the packet path; Save() does the file I/O.
+    std::vector<uint8_t> Snapshot(uint64_t &count) const;
+
+    // Writes a snapshot to dir/name, then deletes the oldest moq-flight-*.bin files in dir beyond
+    // MAX_DUMPS. Returns false if the file couldn't be written.
+    static bool Save(const std::string &dir, const std::string &name, const std::vector<uint8_t> &snapshot);
+
+      private:
+    std::atomic<uint64_t> next{0};
+    std::atomic<uint64_t> errors{0};
+    std::array<Event, CAPACITY> events;
+};
@@ -0,0 +1,221 @@
+#include "moq-relay.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <obs-module.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "logger.h"
+#include "moq-session.h"
+#include "util/platform.h"
+
+namespace {
+
+struct RelayProbe {
+	std::string key;
+	uint64_t start_us;
+	uint64_t ttl_us;
+	std::vector<std::shared_ptr<MoQSession>> sessions;
+};
+
+struct RelayResult {
+	std::string best;
+	uint64_t expires_us;
+};
+
+std::mutex relay_mutex;
+std::unique_ptr<RelayProbe> running;
+std::map<std::string, RelayResult> results;
+bool tick_registered = false;
+
+// The local address the system routes public traffic from, which changes with the network the machine
+// is on. Connecting a UDP socket only picks a route; nothing is sent.
+std::string network_id()
+{
+	std::string id = "unknown";
+
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		return id;
+	}
+	SOCKET fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	bool valid = fd != INVALID_SOCKET;
+#else
+	int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	bool valid = fd >= 0;
+#endif
+
+	if (valid) {
+		struct sockaddr_in remote = {};
+		remote.sin_family = AF_INET;
+		remote.sin_port = htons(53);
+		inet_pton(AF_INET, "192.0.2.1", &remote.sin_addr);
+
+		struct sockaddr_in local = {};
+		socklen_t len = sizeof(local);
+		char address[INET_ADDRSTRLEN] = {};
+
+		if (connect(fd, (struct sockaddr *)&remote, sizeof(remote)) == 0 &&
+		    getsockname(fd, (struct sockaddr *)&local, &len) == 0 &&
+		    inet_ntop(AF_INET, &local.sin_addr, address, sizeof(address))) {
+			id = address;
+		}
+
+#ifdef _WIN32
+		closesocket(fd);
+#else
+		close(fd);
+#endif
+	}
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return id;
+}
+
+std::string cache_key(const std::vector<std::string> &candidates)
+{
+	std::string key = network_id();
+	for (const auto &url : candidates) {
+		key += "\n" + url;
+	}
+	return key;
+}
+
+// Finishes the running probe once a candidate has connected (being first, it has the fastest handshake)
+// or the timeout has passed. The winner's session goes to the session pool, already connected; the others
+// are moved to closing, to be closed outside the lock.
+void collect(uint64_t now_us, std::vector<std::shared_ptr<MoQSession>> &closing)
+{
+	if (!running) {
+		return;
+	}
+
+	std::string best;
+	int best_ms = -1;
+	std::shared_ptr<MoQSession> winner;
+	for (const auto &session : running->sessions) {
+		int ms = session->ConnectTimeSince(running->start_us);
+		if (ms >= 0 && (best_ms < 0 || ms < best_ms)) {
+			best = session->url;
+			best_ms = ms;
+			winner = session;
+		}
+	}
+
+	if (best_ms < 0 && now_us - running->start_us < MoQRelaySelector::PROBE_TIMEOUT_US) {
+		return;
+	}
+
+	if (best_ms >= 0) {
+		LOG_INFO("Selected relay %s (%d ms handshake, %zu candidates)", best.c_str(), best_ms,
+			 running->sessions.size());
+		results[running->key] = {best, now_us + running->ttl_us};
+		MoQSessionPool::Adopt(winner, MoQRelaySelector::WINNER_IDLE_TIMEOUT_US);
+	} else {
+		LOG_WARNING("No relay answered within %llu ms",
+			    (unsigned long long)(MoQRelaySelector::PROBE_TIMEOUT_US / 1000));
+	}
+
+	closing = std::move(running->sessions);
+	running.reset();
+}
+
+} // namespace
+
+void MoQRelaySelector::Probe(const std::vector<std::string> &candidates, uint64_t ttl_us)
+{
+	std::vector<std::shared_ptr<MoQSession>> closing;
+	std::string key = cache_key(candidates);
+	std::lock_guard<std::mutex> lock(relay_mutex);
+	uint64_t now_us = os_gettime_ns() / 1000;
+
+	collect(now_us, closing);
+
+	auto it = results.find(key);
+	if (it != results.end() && now_us < it->second.expires_us) {
+		return;
+	}
+	if (running && running->key == key) {
+		return;
+	}
+	if (running) {
+		closing.insert(closing.end(), running->sessions.begin(), running->sessions.end());
+	}
+
+	LOG_INFO("Probing %zu relays", candidates.size());
+	running.reset(new RelayProbe{key, now_us, ttl_us, {}});
+	for (const auto &url : candidates) {
+		running->sessions.push_back(std::make_shared<MoQSession>(url));
+	}
+
+	if (!tick_registered) {
+		obs_add_tick_callback(Tick, nullptr);
+		tick_registered = true;
+	}
+}
+
+std::string MoQRelaySelector::Select(const std::vector<std::string> &candidates, uint64_t wait_us)
+{
+	std::string key = cache_key(candidates);
+	uint64_t deadline_us = os_gettime_ns() / 1000 + wait_us;
+
+	for (;;) {
+		std::vector<std::shared_ptr<MoQSession>> closing;
+		{
+			std::lock_guard<std::mutex> lock(relay_mutex);
+			uint64_t now_us = os_gettime_ns() / 1000;
+			collect(now_us, closing);
+
+			auto it = results.find(key);
+			if (it != results.end() && now_us < it->second.expires_us) {
+				return it->second.best;
+			}
+			if (!running || running->key != key || now_us >= deadline_us) {
+				break;
+			}
+		}
+
+		os_sleep_ms(5);
+	}
+
+	return candidates.empty() ? std::string() : candidates.front();
+}
+
+void MoQRelaySelector::Shutdown()
+{
+	std::vector<std::shared_ptr<MoQSession>> closing;
+	std::lock_guard<std::mutex> lock(relay_mutex);
+
+	if (tick_registered) {
+		obs_remove_tick_callback(Tick, nullptr);
+		tick_registered = false;
+	}
+
+	if (running) {
+		closing = std::move(running->sessions);
+		running.reset();
+	}
+}
+
+// Runs on the OBS graphics tick, so a probe nobody is waiting on still finishes and closes its sessions.
+void MoQRelaySelector::Tick(void *, float)
+{
+	std::vector<std::shared_ptr<MoQSession>> closing;
+	std::lock_guard<std::mutex> lock(relay_mutex);
+
+	collect(os_gettime_ns() / 1000, closing);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Picks the relay to publish to among several candidates, by the QUIC handshake time to each.
+//
+// Handshakes to all candidates run in parallel, and the result is cached per network (the local address
+// public traffic leaves from) for a TTL, so restarting the stream at the same venue doesn't probe again.
+// libmoq only reports whether an object was accepted, not when it left, so a short throughput sample
+// would only measure its queue; the handshake time is what separates near relays from far ones.
+class MoQRelaySelector
+{
+      public:
+    // How long a probe may take; candidates that haven't connected by then are considered unreachable.
+    static constexpr uint64_t PROBE_TIMEOUT_US = 2000000;
+    // How long the winner's session is kept open for Start() to publish into (see MoQSessionPool::Adopt).
+    static constexpr uint64_t WINNER_IDLE_TIMEOUT_US = 60000000;
+
+    // Starts probing the candidates, unless a fresh result for this network is cached or a probe of the
+    // same candidates is already running.
+    static void Probe(const std::vector<std::string> &candidates, uint64_t ttl_us);
+
+    // The fastest candidate, waiting up to wait_us for a probe in flight (0 returns at once). Falls back
+    // to the first candidate if nothing is known.
+    static std::string Select(const std::vector<std::string> &candidates, uint64_t wait_us);
+
+    static void Shutdown();
+
+      private:
+    static void Tick(void *param, float seconds);
+};
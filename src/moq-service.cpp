@@ -1,18 +1,150 @@
 #include "moq-service.h"
+#include "logger.h"
+#include "moq-relay.h"
+#include "moq-session.h"
+#include "moq-stats.h"
+#include "moq-uplink.h"
+
+#include <algorithm>
+#include <sstream>
 
-// TODO: Define supported codecs.
 const char *audio_codecs[] = {"aac", "opus", nullptr};
-const char *video_codecs[] = {"h264", "hevc", nullptr};
+const char *video_codecs[] = {"h264", "hevc", "av1", "vp9", nullptr};
 
-MoQService::MoQService(obs_data_t *settings, obs_service_t *) : server(), path()
+MoQService::MoQService(obs_data_t *settings, obs_service_t *)
+	: server(),
+	  relays(),
+	  path(),
+	  profile(),
+	  selected_server(),
+	  uplink_probe(false),
+	  prewarm_session(false),
+	  prewarm_idle_timeout_us(0),
+	  probe_ttl_us(0),
+	  used(false),
+	  active(false)
 {
 	Update(settings);
 }
 
+MoQService::~MoQService()
+{
+	MoQSessionPool::Cancel(this);
+}
+
 void MoQService::Update(obs_data_t *settings)
 {
 	server = obs_data_get_string(settings, "server");
 	path = obs_data_get_string(settings, "key");
+	profile = obs_data_get_string(settings, "profile");
+
+	// One URL per line; commas and spaces separate them too.
+	std::string list = obs_data_get_string(settings, "relays");
+	std::replace(list.begin(), list.end(), ',', ' ');
+	std::istringstream words(list);
+	relays.clear();
+	for (std::string url; words >> url;) {
+		relays.push_back(url);
+	}
+
+	probe_ttl_us = (uint64_t)std::max(obs_data_get_int(settings, "relay_probe_ttl"), 1LL) * 60 * 1000000;
+	uplink_probe = obs_data_get_bool(settings, "uplink_probe");
+	prewarm_session = obs_data_get_bool(settings, "prewarm_session");
+	prewarm_idle_timeout_us = (uint64_t)std::max(obs_data_get_int(settings, "prewarm_idle_timeout"), 0LL) * 1000000;
+
+	if (used && !active) {
+		Prepare();
+	}
+}
+
+// Called by OBS on the service an output is starting with, before the output asks for the server. The
+// settings dialog's copies are never initialized, so this is the first point at which connecting is
+// known to be wanted. A session opened here is picked up by the output's Start() moments later.
+//
+// With several relays, the race starts here unless a fresh result is cached, and GetConnectInfo waits
+// for it. Its winner's session becomes the warm one, so it isn't prewarmed separately.
+bool MoQService::Initialize()
+{
+	used = true;
+
+	std::vector<std::string> candidates = Candidates();
+	if (candidates.size() > 1) {
+		MoQRelaySelector::Probe(candidates, probe_ttl_us);
+	} else if (prewarm_session && !candidates.empty()) {
+		MoQSessionPool::Prewarm(this, candidates.front(), prewarm_idle_timeout_us);
+	}
+
+	return true;
+}
+
+// Called when an output starts streaming with this service.
+void MoQService::Activate()
+{
+	used = true;
+	active = true;
+}
+
+void MoQService::Deactivate()
+{
+	active = false;
+	Prepare();
+}
+
+void MoQService::Prepare()
+{
+	std::vector<std::string> candidates = Candidates();
+	if (candidates.size() > 1) {
+		MoQRelaySelector::Probe(candidates, probe_ttl_us);
+	}
+
+	if (uplink_probe && !candidates.empty()) {
+		MoQUplinkProbe::Start(candidates, path, probe_ttl_us);
+	}
+
+	// Opt-in: keep a session open so the next Start Streaming doesn't wait for the QUIC and TLS handshake.
+	// With several relays this is the best one known so far; Start() moves to the probe's pick if it
+	// differs.
+	if (prewarm_session && !candidates.empty()) {
+		MoQSessionPool::Prewarm(this, MoQRelaySelector::Select(candidates, 0), prewarm_idle_timeout_us);
+	} else {
+		MoQSessionPool::Cancel(this);
+	}
+}
+
+// Started from the settings dialog's button. Unlike the refresh after each stream, this measures even if
+// the last result is still fresh, since the user asked for it.
+void MoQService::MeasureUplink()
+{
+	std::vector<std::string> candidates = Candidates();
+	if (candidates.empty()) {
+		return;
+	}
+
+	if (candidates.size() > 1) {
+		MoQRelaySelector::Probe(candidates, probe_ttl_us);
+	}
+	MoQUplinkProbe::Start(candidates, path, 0);
+}
+
+void MoQService::Defaults(obs_data_t *settings)
+{
+	obs_data_set_default_string(settings, "profile", "none");
+	obs_data_set_default_int(settings, "audio_frames_per_object", 1);
+	obs_data_set_default_int(settings, "audio_aggregation_max_ms", 100);
+	obs_data_set_default_bool(settings, "bwtest", false);
+	obs_data_set_default_int(settings, "group_deadline_ms", 0);
+	obs_data_set_default_int(settings, "audio_deadline_ms", 0);
+	obs_data_set_default_int(settings, "stop_flush_ms", 2000);
+	obs_data_set_default_bool(settings, "length_prefixed", false);
+	obs_data_set_default_bool(settings, "capture_timestamps", false);
+	obs_data_set_default_bool(settings, "direct_packets", false);
+	obs_data_set_default_bool(settings, "preconnect_buffer", true);
+	obs_data_set_default_bool(settings, "flight_recorder", false);
+	obs_data_set_default_bool(settings, "prewarm_session", false);
+	obs_data_set_default_int(settings, "prewarm_idle_timeout", 300);
+	obs_data_set_default_string(settings, "relays", "");
+	obs_data_set_default_int(settings, "relay_probe_ttl", 30);
+	obs_data_set_default_bool(settings, "uplink_probe", false);
 }
 
 obs_properties_t *MoQService::Properties()
@@ -24,9 +156,144 @@ obs_properties_t *MoQService::Properties()
 	obs_properties_add_text(ppts, "server", "URL", OBS_TEXT_DEFAULT);
 	obs_properties_add_text(ppts, "key", "Path", OBS_TEXT_DEFAULT);
 
+	// Alternatives to the URL above; the one with the fastest handshake from this network is used.
+	obs_properties_add_text(ppts, "relays", "Alternative Relays (one URL per line)", OBS_TEXT_MULTILINE);
+	obs_properties_add_int(ppts, "relay_probe_ttl", "Relay Probe Cache (minutes)", 1, 1440, 5);
+	obs_properties_add_bool(ppts, "uplink_probe", "Cap bitrates to the measured uplink");
+	obs_properties_add_button(ppts, "measure_uplink", "Measure Uplink Now",
+				  [](obs_properties_t *, obs_property_t *, void *data) -> bool {
+					  if (data) {
+						  static_cast<MoQService *>(data)->MeasureUplink();
+					  }
+					  return false;
+				  });
+
+	obs_property_t *profile = obs_properties_add_list(ppts, "profile", "Latency Profile", OBS_COMBO_TYPE_LIST,
+							  OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(profile, "None (keep encoder settings)", "none");
+	obs_property_list_add_string(profile, "Ultra-low latency", "ultra_low");
+	obs_property_list_add_string(profile, "Low latency", "low");
+	obs_property_list_add_string(profile, "Quality", "quality");
+
+	obs_properties_add_bool(ppts, "wallclock_timestamps", "Anchor timestamps to wall clock");
+	obs_properties_add_bool(ppts, "capture_timestamps", "Embed capture time in video frames");
+
+	// Opus only: several frames per MoQ object, at the cost of up to the max latency.
+	obs_properties_add_int(ppts, "audio_frames_per_object", "Opus Frames per Audio Object", 1, 6, 1);
+	obs_properties_add_int(ppts, "audio_aggregation_max_ms", "Max Audio Aggregation Latency (ms)", 0, 120, 10);
+
+	// Objects later than this after capture are dropped before reaching libmoq.
+	obs_properties_add_int(ppts, "group_deadline_ms", "Video Deadline (ms, 0 = none)", 0, 10000, 100);
+	obs_properties_add_int(ppts, "audio_deadline_ms", "Audio Deadline (ms, 0 = none)", 0, 10000, 100);
+
+	obs_properties_add_int(ppts, "stop_flush_ms", "Stop Flush Timeout (ms, 0 = stop immediately)", 0, 10000, 500);
+
+	obs_properties_add_bool(ppts, "preconnect_buffer", "Hold packets until the session is established");
+	obs_properties_add_bool(ppts, "direct_packets", "Publish packets as encoded (skip A/V interleaving)");
+
+	obs_properties_add_bool(ppts, "length_prefixed", "Publish H.264/HEVC as avc1/hvc1 (parameter sets in catalog)");
+
+	obs_properties_add_bool(ppts, "flight_recorder", "Flight recorder (dump recent events on errors)");
+
+	obs_properties_add_bool(ppts, "bwtest", "Bandwidth test (publish to a hidden path)");
+
+	obs_properties_add_bool(ppts, "prewarm_session", "Keep a session open to the server");
+	obs_properties_add_int(ppts, "prewarm_idle_timeout", "Idle Session Timeout (s, 0 = never)", 0, 3600, 30);
+
 	return ppts;
 }
 
+// Encoder settings for each latency profile. Only the low latency profiles force CBR and touch the
+// encoder's own tuning; "quality" leaves those as the user configured them and only sets the GOP, and
+// "none" changes nothing beyond what the published tracks require.
+struct LatencyProfile {
+	const char *name;
+	// 0 keeps the encoder's keyframe interval.
+	int keyint_sec;
+	bool low_latency;
+	// x264 VBV buffer, in seconds at the target bitrate.
+	double vbv_seconds;
+	const char *x264_tune;
+	const char *x264_opts;
+	const char *nvenc_tune;
+	const char *nvenc_multipass;
+	bool nvenc_lookahead;
+	const char *qsv_latency;
+	const char *amf_preset;
+};
+
+static const LatencyProfile latency_profiles[] = {
+	{"none", 0, false, 0.0, nullptr, nullptr, nullptr, nullptr, false, nullptr, nullptr},
+	{"ultra_low", 1, true, 0.5, "zerolatency", "rc-lookahead=0 sync-lookahead=0 sliced-threads=1", "ull",
+	 "disabled", false, "ultra-low", "speed"},
+	{"low", 2, true, 1.0, "zerolatency", "rc-lookahead=0 sync-lookahead=0", "ll", "qres", false, "low",
+	 "balanced"},
+	{"quality", 2, false, 0.0, nullptr, nullptr, nullptr, nullptr, false, nullptr, nullptr},
+};
+
+enum class EncoderFamily { Unknown, X264, NVENC, QSV, AMF };
+
+static bool has_setting(obs_data_t *settings, const char *name)
+{
+	return obs_data_has_user_value(settings, name) || obs_data_has_default_value(settings, name);
+}
+
+// The settings object doesn't say which encoder it belongs to, and some keys ("tune", "preset") take
+// different values per encoder, so tell them apart by the keys each one registers.
+static EncoderFamily detect_encoder_family(obs_data_t *settings)
+{
+	if (has_setting(settings, "x264opts")) {
+		return EncoderFamily::X264;
+	}
+	if (has_setting(settings, "target_usage")) {
+		return EncoderFamily::QSV;
+	}
+	if (has_setting(settings, "multipass") || has_setting(settings, "preset2")) {
+		return EncoderFamily::NVENC;
+	}
+
+	const char *preset = obs_data_get_string(settings, "preset");
+	if (strcmp(preset, "speed") == 0 || strcmp(preset, "balanced") == 0 || strcmp(preset, "quality") == 0) {
+		return EncoderFamily::AMF;
+	}
+
+	return EncoderFamily::Unknown;
+}
+
+// The user's x264 options with the profile's appended. Options the profile sets are removed from the
+// user's first, so each appears once; everything else the user configured is kept.
+static std::string merge_x264_opts(const char *user_opts, const char *profile_opts)
+{
+	std::vector<std::string> profile_words;
+	std::istringstream profile_stream(profile_opts);
+	for (std::string word; profile_stream >> word;) {
+		profile_words.push_back(word);
+	}
+
+	auto key = [](const std::string &word) {
+		return word.substr(0, word.find('='));
+	};
+
+	std::string merged;
+	std::istringstream user_stream(user_opts ? user_opts : "");
+	for (std::string word; user_stream >> word;) {
+		bool overridden = std::any_of(profile_words.begin(), profile_words.end(),
+					      [&](const std::string &other) { return key(other) == key(word); });
+		if (!overridden) {
+			merged += word + " ";
+		}
+	}
+
+	for (const auto &word : profile_words) {
+		merged += word + " ";
+	}
+
+	if (!merged.empty()) {
+		merged.pop_back();
+	}
+	return merged;
+}
+
 void MoQService::ApplyEncoderSettings(obs_data_t *video_settings, obs_data_t *audio_settings)
 {
 	/*
@@ -36,22 +303,122 @@ void MoQService::ApplyEncoderSettings(obs_data_t *video_settings, obs_data_t *au
      if the front-end optionally calls.
      */
 
-	// Example:
+	const LatencyProfile *p = &latency_profiles[0];
+	for (const auto &candidate : latency_profiles) {
+		if (profile == candidate.name) {
+			p = &candidate;
+		}
+	}
+
+	// What the last uplink probe towards the relay measured, less the same headroom the bandwidth test
+	// recommends. 0 if there is no measurement.
+	long long budget_kbps = 0;
+	std::vector<std::string> candidates = Candidates();
+	if (uplink_probe && !candidates.empty()) {
+		std::string url = candidates.size() > 1 ? MoQRelaySelector::Select(candidates, 0) : candidates.front();
+		budget_kbps = (long long)(MoQUplinkProbe::MeasuredKbps(url) * MoQBandwidthTest::HEADROOM_PERCENT / 100);
+		if (budget_kbps == 0) {
+			LOG_WARNING("No uplink measurement for %s yet, bitrates are not capped; use Measure Uplink Now "
+				    "in the service settings",
+				    url.c_str());
+		}
+	}
+
+	// Audio keeps its bitrate unless it would take more than a tenth of the budget.
+	long long audio_kbps = audio_settings ? obs_data_get_int(audio_settings, "bitrate") : 0;
+	if (budget_kbps > 0 && audio_settings) {
+		long long audio_cap = std::max(budget_kbps / 10, 64LL);
+		if (audio_kbps > audio_cap) {
+			LOG_INFO("Capping audio bitrate to %lld kbps (measured uplink budget %lld kbps)", audio_cap,
+				 budget_kbps);
+			obs_data_set_int(audio_settings, "bitrate", audio_cap);
+			audio_kbps = audio_cap;
+		}
+	}
+
 	if (video_settings) {
+		// Frames are published in decode order with a single timestamp, and the avc3/hev1 tracks
+		// expect parameter sets in-band, regardless of profile.
 		obs_data_set_int(video_settings, "bf", 0);
 		obs_data_set_bool(video_settings, "repeat_headers", true);
-	}
 
-	if (audio_settings) {
-		obs_data_set_int(audio_settings, "bf", 0);
+		// Short GOPs let late joiners start quickly; CBR keeps the send rate predictable.
+		if (p->keyint_sec > 0) {
+			obs_data_set_int(video_settings, "keyint_sec", p->keyint_sec);
+		}
+		if (p->low_latency) {
+			obs_data_set_string(video_settings, "rate_control", "CBR");
+		}
+
+		// Video gets the rest of the budget. A keyframe costs several delta frames, so when the link is
+		// what limits the bitrate they are spaced twice as far apart to leave more of it for the picture.
+		long long video_kbps = obs_data_get_int(video_settings, "bitrate");
+		long long video_cap = std::max(budget_kbps - audio_kbps, 100LL);
+		if (budget_kbps > 0 && video_kbps > video_cap) {
+			LOG_INFO("Capping video bitrate from %lld to %lld kbps (measured uplink budget %lld kbps)",
+				 video_kbps, video_cap, budget_kbps);
+			obs_data_set_int(video_settings, "bitrate", video_cap);
+			long long keyint_sec = obs_data_get_int(video_settings, "keyint_sec");
+			if (keyint_sec > 0) {
+				obs_data_set_int(video_settings, "keyint_sec", keyint_sec * 2);
+			}
+		}
+
+		switch (detect_encoder_family(video_settings)) {
+		case EncoderFamily::X264: {
+			if (!p->low_latency) {
+				break;
+			}
+			// Tight VBV so a single large frame can't turn into a long send queue.
+			int bitrate = (int)obs_data_get_int(video_settings, "bitrate");
+			if (bitrate > 0) {
+				obs_data_set_bool(video_settings, "use_bufsize", true);
+				obs_data_set_int(video_settings, "buffer_size", (int)(bitrate * p->vbv_seconds));
+			}
+			obs_data_set_string(video_settings, "tune", p->x264_tune);
+			std::string opts = merge_x264_opts(obs_data_get_string(video_settings, "x264opts"), p->x264_opts);
+			obs_data_set_string(video_settings, "x264opts", opts.c_str());
+			break;
+		}
+		case EncoderFamily::NVENC:
+			if (p->low_latency) {
+				obs_data_set_string(video_settings, "tune", p->nvenc_tune);
+				obs_data_set_string(video_settings, "multipass", p->nvenc_multipass);
+				obs_data_set_bool(video_settings, "lookahead", p->nvenc_lookahead);
+			}
+			break;
+		case EncoderFamily::QSV:
+			if (p->low_latency) {
+				obs_data_set_string(video_settings, "latency", p->qsv_latency);
+			}
+			obs_data_set_int(video_settings, "bframes", 0);
+			break;
+		case EncoderFamily::AMF:
+			if (p->low_latency) {
+				obs_data_set_string(video_settings, "preset", p->amf_preset);
+			}
+			break;
+		case EncoderFamily::Unknown:
+			break;
+		}
 	}
 }
 
 const char *MoQService::GetConnectInfo(enum obs_service_connect_info type)
 {
 	switch (type) {
-	case OBS_SERVICE_CONNECT_INFO_SERVER_URL:
-		return server.c_str();
+	case OBS_SERVICE_CONNECT_INFO_SERVER_URL: {
+		std::vector<std::string> candidates = Candidates();
+		if (candidates.size() > 1) {
+			// Waits only for a race in flight (started by Initialize on the first start, or once the
+			// cached result expired), at most PROBE_TIMEOUT_US. The winner's session goes to the pool and
+			// Start() publishes into it, so the wait takes the place of Start()'s own handshake.
+			selected_server = MoQRelaySelector::Select(candidates, MoQRelaySelector::PROBE_TIMEOUT_US);
+		} else {
+			selected_server = server;
+		}
+		return selected_server.c_str();
+	}
 	case OBS_SERVICE_CONNECT_INFO_STREAM_KEY:
 		return path.c_str();
 	default:
@@ -61,7 +428,21 @@ const char *MoQService::GetConnectInfo(enum obs_service_connect_info type)
 
 bool MoQService::CanTryToConnect()
 {
-	return !server.empty();
+	return !Candidates().empty();
+}
+
+std::vector<std::string> MoQService::Candidates() const
+{
+	std::vector<std::string> candidates;
+	if (!server.empty()) {
+		candidates.push_back(server);
+	}
+	for (const auto &url : relays) {
+		if (std::find(candidates.begin(), candidates.end(), url) == candidates.end()) {
+			candidates.push_back(url);
+		}
+	}
+	return candidates;
 }
 
 void register_moq_service()
@@ -81,6 +462,17 @@ void register_moq_service()
 	info.update = [](void *priv_data, obs_data_t *settings) {
 		static_cast<MoQService *>(priv_data)->Update(settings);
 	};
+	info.initialize = [](void *priv_data, obs_output_t *) -> bool {
+		return static_cast<MoQService *>(priv_data)->Initialize();
+	};
+	info.activate = [](void *priv_data, obs_data_t *) -> bool {
+		static_cast<MoQService *>(priv_data)->Activate();
+		return true;
+	};
+	info.deactivate = [](void *priv_data) {
+		static_cast<MoQService *>(priv_data)->Deactivate();
+	};
+	info.get_defaults = MoQService::Defaults;
 	info.get_properties = [](void *) -> obs_properties_t * {
 		return MoQService::Properties();
 	};
@@ -93,8 +485,8 @@ void register_moq_service()
 	info.get_output_type = [](void *) -> const char * {
 		return "moq_output";
 	};
-	info.apply_encoder_settings = [](void *, obs_data_t *video_settings, obs_data_t *audio_settings) {
-		MoQService::ApplyEncoderSettings(video_settings, audio_settings);
+	info.apply_encoder_settings = [](void *priv_data, obs_data_t *video_settings, obs_data_t *audio_settings) {
+		static_cast<MoQService *>(priv_data)->ApplyEncoderSettings(video_settings, audio_settings);
 	};
 	info.get_supported_video_codecs = [](void *) -> const char ** {
 		return video_codecs;
@@ -1,18 +1,48 @@
 #pragma once
 #include <string>
+#include <vector>
 #include <obs-module.h>
 
 struct MoQService {
     // TODO: Define needed params to connect to a relay
     std::string server;
+    // Further relays to choose from; the one with the fastest handshake is used (see MoQRelaySelector).
+    std::vector<std::string> relays;
     std::string path;
+    // Latency profile applied to the encoders: "none" (the default), "ultra_low", "low" or "quality".
+    std::string profile;
+
+    // Relay returned by GetConnectInfo, kept alive for the returned pointer.
+    std::string selected_server;
+    // Cap encoder bitrates to the last uplink measurement (see MoQUplinkProbe).
+    bool uplink_probe;
+    bool prewarm_session;
+    uint64_t prewarm_idle_timeout_us;
+    uint64_t probe_ttl_us;
+
+    // Connections (pre-warming, relay and uplink probes) are only opened for a service an output has
+    // started with, never for the temporary copies the settings dialog creates.
+    bool used;
+    // An output is streaming with this service.
+    bool active;
 
     MoQService(obs_data_t *settings, obs_service_t *service);
+    ~MoQService();
 
     void Update(obs_data_t *settings);
+    bool Initialize();
+    void Activate();
+    void Deactivate();
+    // Gets the network side ready for the next Start: relay choice, uplink measurement, warm session.
+    void Prepare();
+    // Measures the uplink right away, so the first stream already has a bitrate budget.
+    void MeasureUplink();
+    static void Defaults(obs_data_t *settings);
     static obs_properties_t *Properties();
-    static void ApplyEncoderSettings(obs_data_t *video_settings, obs_data_t *audio_settings);
+    void ApplyEncoderSettings(obs_data_t *video_settings, obs_data_t *audio_settings);
     bool CanTryToConnect();
+    // server followed by relays, without duplicates.
+    std::vector<std::string> Candidates() const;
     const char *GetConnectInfo(enum obs_service_connect_info type);
 };
 
@@ -0,0 +1,247 @@
+#include "moq-session.h"
+
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <obs-module.h>
+
+#include "logger.h"
+#include "util/platform.h"
+
+extern "C" {
+#include "moq.h"
+}
+
+MoQSession::MoQSession(const std::string &url)
+	: url(url),
+	  origin(moq_origin_create()),
+	  session(0),
+	  connect_start_us(os_gettime_ns() / 1000),
+	  connected_us(0),
+	  closed(false)
+{
+	// NOTE: You could publish the same broadcasts to multiple sessions if you want (redundant ingest).
+	session = moq_session_connect(url.data(), url.size(), origin, 0, OnStatus, this);
+	if (session < 0) {
+		LOG_ERROR("Failed to initialize MoQ server: %d", session);
+	}
+}
+
+MoQSession::~MoQSession()
+{
+	if (session > 0) {
+		moq_session_close(session);
+	}
+
+	moq_origin_close(origin);
+}
+
+void MoQSession::OnStatus(void *user_data, int error_code)
+{
+	auto self = static_cast<MoQSession *>(user_data);
+	uint64_t now_us = os_gettime_ns() / 1000;
+
+	if (error_code == 0) {
+		self->connected_us = now_us;
+		LOG_INFO("MoQ session established (%d ms): %s", (int)((now_us - self->connect_start_us) / 1000),
+			 self->url.c_str());
+	} else {
+		self->closed.store(true, std::memory_order_release);
+		LOG_INFO("MoQ session closed (%d): %s", error_code, self->url.c_str());
+	}
+}
+
+int MoQSession::ConnectTimeSince(uint64_t start_us) const
+{
+	uint64_t connected = connected_us.load(std::memory_order_relaxed);
+	if (connected == 0) {
+		return -1;
+	}
+
+	return connected > start_us ? (int)((connected - start_us) / 1000) : 0;
+}
+
+namespace {
+
+std::mutex pool_mutex;
+std::shared_ptr<MoQSession> warm;
+// The service the warm session was opened for; only it can cancel it.
+const void *warm_owner = nullptr;
+uint64_t warm_idle_timeout_us = 0;
+// When the warm session was last handed back by an output, or 0 while one is using it.
+uint64_t warm_idle_since_us = 0;
+bool warm_in_use = false;
+bool tick_registered = false;
+// Sessions closed by an output, kept open until the time paired with them so queued objects can drain.
+std::vector<std::pair<std::shared_ptr<MoQSession>, uint64_t>> lingering;
+
+void register_tick(void (*tick)(void *, float))
+{
+	if (!tick_registered) {
+		obs_add_tick_callback(tick, nullptr);
+		tick_registered = true;
+	}
+}
+
+} // namespace
+
+void MoQSessionPool::Prewarm(const void *owner, const std::string &url, uint64_t idle_timeout_us)
+{
+	std::shared_ptr<MoQSession> old;
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	warm_owner = owner;
+	warm_idle_timeout_us = idle_timeout_us;
+
+	if (warm && warm->url == url && warm->Usable()) {
+		return;
+	}
+
+	// An output still publishing into the old session keeps it alive until it stops.
+	old = std::move(warm);
+	LOG_INFO("Pre-warming MoQ session: %s", url.c_str());
+	warm = std::make_shared<MoQSession>(url);
+	warm_in_use = false;
+	warm_idle_since_us = os_gettime_ns() / 1000;
+
+	register_tick(Tick);
+}
+
+void MoQSessionPool::Cancel(const void *owner)
+{
+	std::shared_ptr<MoQSession> old;
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	if (owner != warm_owner) {
+		return;
+	}
+
+	old = std::move(warm);
+	warm_owner = nullptr;
+	warm_in_use = false;
+}
+
+void MoQSessionPool::Adopt(std::shared_ptr<MoQSession> session, uint64_t idle_timeout_us)
+{
+	std::shared_ptr<MoQSession> old;
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	if (!session->Usable() || warm_in_use || (warm && warm->url == session->url && warm->Usable())) {
+		return;
+	}
+
+	old = std::move(warm);
+	warm = std::move(session);
+	warm_owner = nullptr;
+	warm_idle_timeout_us = idle_timeout_us;
+	warm_in_use = false;
+	warm_idle_since_us = os_gettime_ns() / 1000;
+
+	register_tick(Tick);
+}
+
+std::shared_ptr<MoQSession> MoQSessionPool::Acquire(const std::string &url)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		if (warm && warm->url == url && warm->Usable() && !warm_in_use) {
+			warm_in_use = true;
+			LOG_INFO("Reusing warm MoQ session: %s", url.c_str());
+			return warm;
+		}
+	}
+
+	return std::make_shared<MoQSession>(url);
+}
+
+void MoQSessionPool::Release(std::shared_ptr<MoQSession> &session, uint64_t linger_us)
+{
+	std::shared_ptr<MoQSession> old = std::move(session);
+	if (!old) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	uint64_t now_us = os_gettime_ns() / 1000;
+
+	if (old == warm) {
+		warm_in_use = false;
+		warm_idle_since_us = now_us;
+
+		if (!warm->Usable()) {
+			warm.reset();
+		}
+	} else if (linger_us > 0 && old->Usable()) {
+		lingering.emplace_back(std::move(old), now_us + linger_us);
+		register_tick(Tick);
+	}
+}
+
+void MoQSessionPool::Retire(std::shared_ptr<MoQSession> &session, uint64_t linger_us)
+{
+	std::shared_ptr<MoQSession> old = std::move(session);
+	if (!old) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	if (old == warm) {
+		warm.reset();
+		warm_in_use = false;
+	}
+
+	if (linger_us > 0 && old->Usable()) {
+		lingering.emplace_back(std::move(old), os_gettime_ns() / 1000 + linger_us);
+		register_tick(Tick);
+	}
+}
+
+void MoQSessionPool::Shutdown()
+{
+	std::shared_ptr<MoQSession> old;
+	std::vector<std::pair<std::shared_ptr<MoQSession>, uint64_t>> closing;
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	if (tick_registered) {
+		obs_remove_tick_callback(Tick, nullptr);
+		tick_registered = false;
+	}
+
+	old = std::move(warm);
+	closing.swap(lingering);
+}
+
+// Runs on the OBS graphics tick; closes lingering sessions once their time is up, and the warm session
+// once it has been idle for too long. A warm session the relay closed is dropped so the next Start()
+// reconnects.
+void MoQSessionPool::Tick(void *, float)
+{
+	std::shared_ptr<MoQSession> old;
+	std::vector<std::shared_ptr<MoQSession>> closing;
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	uint64_t now_us = os_gettime_ns() / 1000;
+
+	for (auto it = lingering.begin(); it != lingering.end();) {
+		if (now_us >= it->second || !it->first->Usable()) {
+			closing.push_back(std::move(it->first));
+			it = lingering.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	if (!warm || warm_in_use) {
+		return;
+	}
+
+	if (!warm->Usable()) {
+		old = std::move(warm);
+		return;
+	}
+
+	if (warm_idle_timeout_us > 0 && now_us - warm_idle_since_us > warm_idle_timeout_us) {
+		LOG_INFO("Closing idle MoQ session: %s", warm->url.c_str());
+		old = std::move(warm);
+	}
+}
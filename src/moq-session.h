@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// A MoQ session and the origin whose broadcasts it publishes. Closed when the last reference goes away.
+class MoQSession
+{
+      public:
+    explicit MoQSession(const std::string &url);
+    ~MoQSession();
+
+    MoQSession(const MoQSession &) = delete;
+    MoQSession &operator=(const MoQSession &) = delete;
+
+    const std::string url;
+    int origin;
+    int session;
+
+    // False once connecting failed or the session was closed by the remote end.
+    bool Usable() const
+    {
+        return session > 0 && !closed.load(std::memory_order_acquire);
+    }
+
+    // Time from start_us until the session was established: 0 if it already was, -1 while pending.
+    int ConnectTimeSince(uint64_t start_us) const;
+
+      private:
+    static void OnStatus(void *user_data, int error_code);
+
+    uint64_t connect_start_us;
+    // os_gettime_ns() / 1000 when the handshake completed, 0 while pending.
+    std::atomic<uint64_t> connected_us;
+    std::atomic<bool> closed;
+};
+
+// Sessions shared between the service, which may open one as soon as it knows the server, and the
+// output, which publishes into it on Start(). A warm session is kept open across stop/start cycles
+// until it has been idle for the configured timeout.
+class MoQSessionPool
+{
+      public:
+    // Opens (or keeps) a warm session to url on behalf of owner (the service). A timeout of 0 keeps it
+    // until the settings change.
+    static void Prewarm(const void *owner, const std::string &url, uint64_t idle_timeout_us);
+    // Drops the warm session if owner opened it, closing it unless an output is still publishing into it.
+    static void Cancel(const void *owner);
+    // Keeps an already connected session (the relay probe's winner) as the warm one, so the next Start()
+    // skips the handshake. Ignored while an output uses the warm session or it already goes to that url.
+    static void Adopt(std::shared_ptr<MoQSession> session, uint64_t idle_timeout_us);
+
+    // Returns the warm session for url if there is a usable one, else a new session.
+    static std::shared_ptr<MoQSession> Acquire(const std::string &url);
+    // Hands a session back once the output is done with it; the idle timeout starts now. A session that
+    // isn't kept warm is closed, after lingering for up to linger_us so libmoq can send what it queued.
+    static void Release(std::shared_ptr<MoQSession> &session, uint64_t linger_us = 0);
+    // Like Release, for a session a broadcast is still published on: it is closed after linger_us even
+    // if it was the warm one, which is no longer kept.
+    static void Retire(std::shared_ptr<MoQSession> &session, uint64_t linger_us);
+
+    static void Shutdown();
+
+      private:
+    static void Tick(void *param, float seconds);
+};
@@ -5,6 +5,7 @@
 #include <util/dstr.h>
 
 #include <atomic>
+#include <chrono>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -15,6 +16,7 @@ extern "C" {
 }
 
 #include "moq-source.h"
+#include "moq-capture-time.h"
 #include "logger.h"
 
 // Map codec string from moq_video_config to FFmpeg codec ID
@@ -58,6 +60,22 @@ static AVCodecID codec_string_to_id(const char *codec, size_t len)
 	return AV_CODEC_ID_NONE;
 }
 
+// Frames searched for a capture time before giving up on the publisher embedding them (~10 s at 30 fps).
+static const uint32_t CAPTURE_TIME_GIVE_UP_FRAMES = 300;
+
+// How the capture time would be wrapped in this payload. H.264 and HEVC arrive either as Annex B or
+// with length prefixes, depending on the publisher.
+static MoQBitstream capture_time_bitstream(AVCodecID codec_id, const uint8_t *data, size_t size)
+{
+	if (codec_id == AV_CODEC_ID_AV1) {
+		return MoQBitstream::AV1;
+	}
+
+	bool start_code = size >= 4 && data[0] == 0 && data[1] == 0 &&
+	                  (data[2] == 1 || (data[2] == 0 && data[3] == 1));
+	return start_code ? MoQBitstream::AnnexB : MoQBitstream::LengthPrefixed;
+}
+
 struct moq_source {
 	obs_source_t *source;
 
@@ -86,6 +104,17 @@ struct moq_source {
 	uint32_t frames_waiting_for_keyframe;  // Count of skipped frames while waiting
 	uint32_t consecutive_decode_errors;    // Count of consecutive decode failures
 
+	// Glass-to-glass latency, from capture times embedded by a publisher with capture_timestamps on.
+	// The capture time is remembered with the pts of the packet it came in, and matched against the
+	// decoded frame, so decoder delay is included. Allocated with new, since the struct itself isn't
+	// constructed.
+	MoQLatencyHistogram *latency;
+	int64_t capture_pts;
+	int64_t capture_time_us;
+	// Frames since the last capture time; past CAPTURE_TIME_GIVE_UP_FRAMES the publisher is assumed
+	// not to embed them and frames aren't searched until the decoder is set up again.
+	uint32_t frames_without_capture_time;
+
 	// Output frame buffer
 	struct obs_source_frame frame;
 	uint8_t *frame_buffer;
@@ -112,6 +141,7 @@ static void moq_source_blank_video(struct moq_source *ctx);
 static bool moq_source_init_decoder(struct moq_source *ctx, const struct moq_video_config *config);
 static void moq_source_destroy_decoder_locked(struct moq_source *ctx);
 static void moq_source_decode_frame(struct moq_source *ctx, int32_t frame_id);
+static void moq_source_get_latency(void *data, calldata_t *cd);
 
 static void *moq_source_create(obs_data_t *settings, obs_source_t *source)
 {
@@ -139,6 +169,10 @@ static void *moq_source_create(obs_data_t *settings, obs_source_t *source)
 	ctx->frames_waiting_for_keyframe = 0;
 	ctx->consecutive_decode_errors = 0;
 	ctx->frame_buffer = NULL;
+	ctx->latency = new MoQLatencyHistogram();
+	ctx->latency->Reset();
+	ctx->capture_time_us = 0;
+	ctx->frames_without_capture_time = 0;
 
 	// Initialize threading
 	pthread_mutex_init(&ctx->mutex, NULL);
@@ -149,6 +183,9 @@ static void *moq_source_create(obs_data_t *settings, obs_source_t *source)
 	ctx->frame.format = VIDEO_FORMAT_RGBA;
 	ctx->frame.linesize[0] = 0;
 
+	proc_handler_t *ph = obs_source_get_proc_handler(source);
+	proc_handler_add(ph, "void get_latency(out string stats)", moq_source_get_latency, ctx);
+
 	// Load settings from OBS - this will auto-connect if settings are valid
 	// (moq_source_update detects settings changed from NULL and reconnects)
 	moq_source_update(ctx, settings);
@@ -188,6 +225,7 @@ static void moq_source_destroy(void *data)
 
 	pthread_mutex_destroy(&ctx->mutex);
 
+	delete ctx->latency;
 	bfree(ctx);
 }
 
@@ -720,6 +758,8 @@ static bool moq_source_init_decoder(struct moq_source *ctx, const struct moq_vid
 	ctx->got_keyframe = false;
 	ctx->frames_waiting_for_keyframe = 0;
 	ctx->consecutive_decode_errors = 0;
+	// A new catalog may come from a new publisher, which may embed capture times.
+	ctx->frames_without_capture_time = 0;
 
 	pthread_mutex_unlock(&ctx->mutex);
 
@@ -831,6 +871,21 @@ static void moq_source_decode_frame(struct moq_source *ctx, int32_t frame_id)
 	packet->pts = frame_data.timestamp_us / 1000; // Convert to milliseconds
 	packet->dts = packet->pts;
 
+	if (ctx->frames_without_capture_time < CAPTURE_TIME_GIVE_UP_FRAMES) {
+		int64_t capture_time_us;
+		if (capture_time_find(frame_data.payload, frame_data.payload_size,
+		                      capture_time_bitstream(ctx->current_codec_id, frame_data.payload,
+		                                             frame_data.payload_size),
+		                      ctx->current_codec_id == AV_CODEC_ID_HEVC, capture_time_us)) {
+			ctx->capture_pts = packet->pts;
+			ctx->capture_time_us = capture_time_us;
+			ctx->frames_without_capture_time = 0;
+		} else if (++ctx->frames_without_capture_time == CAPTURE_TIME_GIVE_UP_FRAMES) {
+			LOG_DEBUG("No capture times in the last %u frames, no longer looking for them",
+			          CAPTURE_TIME_GIVE_UP_FRAMES);
+		}
+	}
+
 	// Send packet to decoder
 	int ret = avcodec_send_packet(ctx->codec_ctx, packet);
 	av_packet_free(&packet);
@@ -994,11 +1049,63 @@ static void moq_source_decode_frame(struct moq_source *ctx, int32_t frame_id)
 	ctx->frame.timestamp = frame_data.timestamp_us;
 	obs_source_output_video(ctx->source, &ctx->frame);
 
+	if (ctx->capture_time_us > 0 && frame->pts == ctx->capture_pts) {
+		int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+					 std::chrono::system_clock::now().time_since_epoch())
+					 .count();
+		ctx->latency->Add(now_us - ctx->capture_time_us);
+		ctx->capture_time_us = 0;
+
+		const MoQLatencyHistogram &latency = *ctx->latency;
+		uint64_t count = latency.count.load();
+		if (count == 1 || count % 900 == 0) {
+			LOG_INFO("Glass-to-glass latency: last %lld ms, p50 %lld ms, p95 %lld ms, max %lld ms (%llu frames)",
+			         (long long)(latency.last_us.load() / 1000), (long long)latency.PercentileMs(50),
+			         (long long)latency.PercentileMs(95), (long long)(latency.max_us.load() / 1000),
+			         (unsigned long long)count);
+		}
+	}
+
 	av_frame_free(&frame);
 	pthread_mutex_unlock(&ctx->mutex);
 	moq_consume_frame_close(frame_id);
 }
 
+// Latency report for scripts and tools, as JSON. Percentiles are bucket upper bounds; -1 means no
+// frame with a capture time has been decoded yet.
+static void moq_source_get_latency(void *data, calldata_t *cd)
+{
+	struct moq_source *ctx = (struct moq_source *)data;
+	const MoQLatencyHistogram &latency = *ctx->latency;
+	uint64_t count = latency.count.load();
+
+	obs_data_t *stats = obs_data_create();
+	obs_data_set_int(stats, "frames", (long long)count);
+	obs_data_set_int(stats, "last_ms", count ? latency.last_us.load() / 1000 : -1);
+	obs_data_set_int(stats, "min_ms", count ? latency.min_us.load() / 1000 : -1);
+	obs_data_set_int(stats, "max_ms", count ? latency.max_us.load() / 1000 : -1);
+	obs_data_set_int(stats, "mean_ms", count ? (long long)(latency.sum_us.load() / count / 1000) : -1);
+	obs_data_set_int(stats, "p50_ms", latency.PercentileMs(50));
+	obs_data_set_int(stats, "p95_ms", latency.PercentileMs(95));
+	obs_data_set_int(stats, "p99_ms", latency.PercentileMs(99));
+
+	obs_data_array_t *buckets = obs_data_array_create();
+	for (size_t i = 0; i < latency.buckets.size(); i++) {
+		obs_data_t *bucket = obs_data_create();
+		obs_data_set_int(bucket, "le_ms", i < MoQLatencyHistogram::BOUNDS_MS.size()
+		                                          ? (long long)MoQLatencyHistogram::BOUNDS_MS[i]
+		                                          : -1);
+		obs_data_set_int(bucket, "frames", (long long)latency.buckets[i].load());
+		obs_data_array_push_back(buckets, bucket);
+		obs_data_release(bucket);
+	}
+	obs_data_set_array(stats, "buckets", buckets);
+	obs_data_array_release(buckets);
+
+	calldata_set_string(cd, "stats", obs_data_get_json(stats));
+	obs_data_release(stats);
+}
+
 // Registration function
 void register_moq_source()
 {
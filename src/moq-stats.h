@@ -0,0 +1,331 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Sums a quantity (bytes, objects, drops) over the last second.
+//
+// Written from the output thread only; any thread may read it without taking a lock.
+// A reader racing with a bucket rollover may see a slightly stale total, which is fine for stats.
+class MoQWindowCounter
+{
+      public:
+    static constexpr uint64_t BUCKET_US = 100000;
+    static constexpr size_t BUCKETS = 10;
+    static constexpr uint64_t WINDOW_US = BUCKET_US * BUCKETS;
+
+    void Add(uint64_t now_us, uint64_t value)
+    {
+        uint64_t epoch = now_us / BUCKET_US;
+        Bucket &bucket = buckets[epoch % BUCKETS];
+
+        if (bucket.epoch.load(std::memory_order_relaxed) != epoch) {
+            // Clear before publishing the new epoch so readers never count the old value twice.
+            bucket.value.store(0, std::memory_order_relaxed);
+            bucket.epoch.store(epoch, std::memory_order_release);
+        }
+
+        bucket.value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t Sum(uint64_t now_us) const
+    {
+        uint64_t epoch = now_us / BUCKET_US;
+        uint64_t sum = 0;
+
+        for (const Bucket &bucket : buckets) {
+            uint64_t bucket_epoch = bucket.epoch.load(std::memory_order_acquire);
+            if (bucket_epoch + BUCKETS > epoch && bucket_epoch <= epoch) {
+                sum += bucket.value.load(std::memory_order_relaxed);
+            }
+        }
+
+        return sum;
+    }
+
+    void Reset()
+    {
+        for (Bucket &bucket : buckets) {
+            bucket.value.store(0, std::memory_order_relaxed);
+            bucket.epoch.store(0, std::memory_order_relaxed);
+        }
+    }
+
+      private:
+    struct Bucket {
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<uint64_t> value{0};
+    };
+
+    std::array<Bucket, BUCKETS> buckets;
+};
+
+// Per-track publish counters, polled by the OBS stats dock and the output's get_stats proc.
+struct MoQTrackStats {
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> objects{0};
+    // Number of groups started, i.e. keyframes published.
+    std::atomic<uint64_t> groups{0};
+    // Size of the last keyframe and of the largest object, which bound how long one object holds up
+    // delivery.
+    std::atomic<uint64_t> keyframe_bytes{0};
+    std::atomic<uint64_t> max_object_bytes{0};
+    std::atomic<uint64_t> drops{0};
+    std::atomic<uint64_t> dropped_bytes{0};
+    // Objects skipped because their group had expired; also counted in drops.
+    std::atomic<uint64_t> expired{0};
+    std::atomic<uint64_t> expired_bytes{0};
+    // Time between OBS timestamping the packet (sys_dts_usec) and it reaching libmoq, for the last packet.
+    std::atomic<uint64_t> queue_delay_us{0};
+
+    MoQWindowCounter bytes_window;
+    MoQWindowCounter objects_window;
+    MoQWindowCounter drops_window;
+
+    void Sent(uint64_t now_us, size_t size, bool keyframe)
+    {
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        objects.fetch_add(1, std::memory_order_relaxed);
+        if (keyframe) {
+            groups.fetch_add(1, std::memory_order_relaxed);
+            keyframe_bytes.store(size, std::memory_order_relaxed);
+        }
+        if (size > max_object_bytes.load(std::memory_order_relaxed)) {
+            max_object_bytes.store(size, std::memory_order_relaxed);
+        }
+
+        bytes_window.Add(now_us, size);
+        objects_window.Add(now_us, 1);
+    }
+
+    void Dropped(uint64_t now_us, size_t size)
+    {
+        drops.fetch_add(1, std::memory_order_relaxed);
+        dropped_bytes.fetch_add(size, std::memory_order_relaxed);
+        drops_window.Add(now_us, 1);
+    }
+
+    void Expired(uint64_t now_us, size_t size)
+    {
+        expired.fetch_add(1, std::memory_order_relaxed);
+        expired_bytes.fetch_add(size, std::memory_order_relaxed);
+        Dropped(now_us, size);
+    }
+
+    uint64_t SendRate(uint64_t now_us) const
+    {
+        // Bits per second over the window.
+        return bytes_window.Sum(now_us) * 8 * 1000000 / MoQWindowCounter::WINDOW_US;
+    }
+
+    void Reset()
+    {
+        bytes = 0;
+        objects = 0;
+        groups = 0;
+        keyframe_bytes = 0;
+        max_object_bytes = 0;
+        drops = 0;
+        dropped_bytes = 0;
+        expired = 0;
+        expired_bytes = 0;
+        queue_delay_us = 0;
+        bytes_window.Reset();
+        objects_window.Reset();
+        drops_window.Reset();
+    }
+};
+
+// Encoder parameters describing a track, refreshed while live so reconfiguration is picked up.
+// Zero means unknown or not applicable (e.g. width on an audio track).
+struct MoQTrackInfo {
+    std::atomic<uint32_t> bitrate_kbps{0};
+    std::atomic<uint32_t> width{0};
+    std::atomic<uint32_t> height{0};
+    std::atomic<uint32_t> fps_num{0};
+    std::atomic<uint32_t> fps_den{0};
+    std::atomic<uint32_t> sample_rate{0};
+    std::atomic<uint32_t> channels{0};
+    // When the encoder was last queried, to rate limit the checks done on the output thread.
+    uint64_t checked_us = 0;
+
+    void Reset()
+    {
+        bitrate_kbps = 0;
+        width = 0;
+        height = 0;
+        fps_num = 0;
+        fps_den = 0;
+        sample_rate = 0;
+        channels = 0;
+        checked_us = 0;
+    }
+};
+
+// Direct packets mode: the same packets reach the output straight from the encoders and, later, through
+// OBS's interleaver. The difference between their average age on arrival (now - sys_dts_usec) is the
+// delay interleaving would have added.
+struct MoQInterleaveDelay {
+    std::atomic<uint64_t> direct_packets{0};
+    std::atomic<uint64_t> direct_age_us{0};
+    std::atomic<uint64_t> interleaved_packets{0};
+    std::atomic<uint64_t> interleaved_age_us{0};
+
+    void Reset()
+    {
+        direct_packets = 0;
+        direct_age_us = 0;
+        interleaved_packets = 0;
+        interleaved_age_us = 0;
+    }
+
+    void Add(bool interleaved, uint64_t now_us, int64_t sys_dts_usec)
+    {
+        if (sys_dts_usec <= 0 || (uint64_t)sys_dts_usec > now_us) {
+            return;
+        }
+
+        uint64_t age = now_us - (uint64_t)sys_dts_usec;
+        if (interleaved) {
+            interleaved_packets.fetch_add(1, std::memory_order_relaxed);
+            interleaved_age_us.fetch_add(age, std::memory_order_relaxed);
+        } else {
+            direct_packets.fetch_add(1, std::memory_order_relaxed);
+            direct_age_us.fetch_add(age, std::memory_order_relaxed);
+        }
+    }
+
+    // Average delay removed per packet, or -1 until both paths have seen packets.
+    int64_t AverageUs() const
+    {
+        uint64_t direct = direct_packets.load(std::memory_order_relaxed);
+        uint64_t interleaved = interleaved_packets.load(std::memory_order_relaxed);
+        if (direct == 0 || interleaved == 0) {
+            return -1;
+        }
+
+        return (int64_t)(interleaved_age_us.load(std::memory_order_relaxed) / interleaved) -
+               (int64_t)(direct_age_us.load(std::memory_order_relaxed) / direct);
+    }
+};
+
+// Throughput summary for bandwidth test mode, sampled once per window from the output thread.
+//
+// libmoq accepts objects into a local queue, so the accepted rate is just the encoder bitrate. What the
+// relay actually delivered is read back through a MoQLoopback subscribed to the video track; when less of
+// the video comes back than was sent, the link is the limit and the delivered rate is what it carries.
+// RTT isn't available through libmoq's C API.
+struct MoQBandwidthTest {
+    // Ignore the first seconds, which include session setup and the first keyframe burst.
+    static constexpr uint64_t WARMUP_US = 2 * MoQWindowCounter::WINDOW_US;
+    // Share of the delivered rate to recommend, leaving headroom for encoder spikes and cross traffic.
+    static constexpr uint64_t HEADROOM_PERCENT = 80;
+    // Below this share of the video coming back, the link is what limits the stream.
+    static constexpr double LIMITED_RATIO = 0.95;
+
+    std::atomic<uint64_t> samples{0};
+    // Accepted by libmoq, all tracks and video only.
+    std::atomic<uint64_t> rate_sum_bps{0};
+    std::atomic<uint64_t> video_rate_sum_bps{0};
+    // Video delivered back through the relay.
+    std::atomic<uint64_t> delivered_sum_bps{0};
+    std::atomic<uint64_t> min_delivered_bps{0};
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> dropped{0};
+    uint64_t start_us = 0;
+    uint64_t next_sample_us = 0;
+    uint64_t last_sample_us = 0;
+    uint64_t last_delivered_bytes = 0;
+
+    void Reset(uint64_t now_us)
+    {
+        samples = 0;
+        rate_sum_bps = 0;
+        video_rate_sum_bps = 0;
+        delivered_sum_bps = 0;
+        min_delivered_bps = 0;
+        sent = 0;
+        dropped = 0;
+        start_us = now_us;
+        next_sample_us = now_us + WARMUP_US;
+        last_sample_us = 0;
+        last_delivered_bytes = 0;
+    }
+
+    // Whether a full window has elapsed since the last sample (or the warm-up).
+    bool Due(uint64_t now_us) const
+    {
+        return now_us >= next_sample_us;
+    }
+
+    // Records the window ending at now_us. delivered_bytes is the loopback's running total; the first call
+    // after the warm-up only takes it as the baseline.
+    void Sample(uint64_t now_us, uint64_t rate_bps, uint64_t video_rate_bps, uint64_t delivered_bytes,
+                uint64_t window_sent, uint64_t window_dropped)
+    {
+        next_sample_us = now_us + MoQWindowCounter::WINDOW_US;
+
+        if (last_sample_us == 0) {
+            last_sample_us = now_us;
+            last_delivered_bytes = delivered_bytes;
+            return;
+        }
+
+        uint64_t delivered_bps = (delivered_bytes - last_delivered_bytes) * 8 * 1000000 / (now_us - last_sample_us);
+        last_sample_us = now_us;
+        last_delivered_bytes = delivered_bytes;
+
+        if (samples == 0 || delivered_bps < min_delivered_bps) {
+            min_delivered_bps = delivered_bps;
+        }
+        rate_sum_bps += rate_bps;
+        video_rate_sum_bps += video_rate_bps;
+        delivered_sum_bps += delivered_bps;
+        sent += window_sent;
+        dropped += window_dropped;
+        samples++;
+    }
+
+    uint64_t AverageRate() const
+    {
+        uint64_t count = samples.load(std::memory_order_relaxed);
+        return count ? rate_sum_bps.load(std::memory_order_relaxed) / count : 0;
+    }
+
+    uint64_t AverageDeliveredRate() const
+    {
+        uint64_t count = samples.load(std::memory_order_relaxed);
+        return count ? delivered_sum_bps.load(std::memory_order_relaxed) / count : 0;
+    }
+
+    // Share of the video that came back through the relay.
+    double DeliveryRatio() const
+    {
+        uint64_t video = video_rate_sum_bps.load(std::memory_order_relaxed);
+        return video ? (double)delivered_sum_bps.load(std::memory_order_relaxed) / (double)video : 0.0;
+    }
+
+    bool LinkLimited() const
+    {
+        return samples.load(std::memory_order_relaxed) > 0 && DeliveryRatio() < LIMITED_RATIO;
+    }
+
+    double Loss() const
+    {
+        uint64_t total = sent.load(std::memory_order_relaxed) + dropped.load(std::memory_order_relaxed);
+        return total ? (double)dropped.load(std::memory_order_relaxed) / (double)total : 0.0;
+    }
+
+    // Only known when the link was the limit: what got through (delivered video plus the audio), less
+    // headroom. 0 otherwise, since the link then carried the configured bitrate and may carry more.
+    uint64_t RecommendedKbps() const
+    {
+        if (!LinkLimited()) {
+            return 0;
+        }
+
+        uint64_t count = samples.load(std::memory_order_relaxed);
+        uint64_t audio_bps = AverageRate() - video_rate_sum_bps.load(std::memory_order_relaxed) / count;
+        return (AverageDeliveredRate() + audio_bps) * HEADROOM_PERCENT / 100 / 1000;
+    }
+};
@@ -0,0 +1,120 @@
+#include "moq-timestamp.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "logger.h"
+#include "util/platform.h"
+#include "util/util_uint64.h"
+
+void MoQTimestamps::Reset(bool wallclock, bool independent)
+{
+	this->wallclock = wallclock;
+	this->independent = independent;
+	has_epoch = false;
+	epoch_us = 0;
+	epoch_sys_us = 0;
+	base_us = 0;
+}
+
+int64_t MoQTimestamps::ToUnixMicros(int64_t sys_time_us)
+{
+	int64_t now_us = (int64_t)(os_gettime_ns() / 1000);
+	int64_t unix_us =
+		std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch())
+			.count();
+
+	return unix_us - (now_us - sys_time_us);
+}
+
+int64_t MoQTimestamps::ToMicros(int64_t ts, int32_t num, int32_t den)
+{
+	if (num <= 0 || den <= 0) {
+		return 0;
+	}
+
+	// Split ts into whole timebase periods and a non-negative remainder, so the fractional part can use
+	// the unsigned 128-bit helper and the result rounds towards negative infinity for negative inputs.
+	int64_t whole = ts / den;
+	int64_t rem = ts % den;
+	if (rem < 0) {
+		whole -= 1;
+		rem += den;
+	}
+
+	int64_t us = whole * num * 1000000LL;
+	us += (int64_t)util_mul_div64((uint64_t)rem, (uint64_t)num * 1000000ULL, (uint64_t)den);
+
+	return us;
+}
+
+bool MoQTimestamps::Normalize(MoQTrackTimeline &track, const struct encoder_packet *packet, uint64_t &pts_us)
+{
+	int64_t pts = ToMicros(packet->pts, packet->timebase_num, packet->timebase_den);
+	int64_t dts = ToMicros(packet->dts, packet->timebase_num, packet->timebase_den);
+
+	if (!has_epoch) {
+		has_epoch = true;
+		epoch_us = dts;
+		epoch_sys_us = packet->sys_dts_usec;
+
+		if (wallclock && packet->sys_dts_usec > 0) {
+			// Map the capture time of this packet (monotonic clock) onto the system clock.
+			base_us = ToUnixMicros(packet->sys_dts_usec);
+		} else {
+			base_us = HEADROOM_US;
+		}
+
+		LOG_INFO("Publish epoch set at %lld us (%s)", (long long)epoch_us,
+			 wallclock ? "wall clock" : "relative");
+	}
+
+	if (independent && !track.started && packet->sys_dts_usec > 0) {
+		track.offset_us = (packet->sys_dts_usec - epoch_sys_us) - (dts - epoch_us);
+	}
+
+	dts += track.offset_us + track.correction_us;
+	pts += track.offset_us + track.correction_us;
+
+	// Pay an earlier correction back, by at most half of each step the input takes, so the track keeps
+	// moving forward while it returns to the shared timeline instead of staying shifted for good.
+	if (track.started && track.correction_us > 0) {
+		int64_t step = dts - track.last_dts_us;
+		if (step > 1) {
+			int64_t repaid = std::min(track.correction_us, step / 2);
+			track.correction_us -= repaid;
+			dts -= repaid;
+			pts -= repaid;
+
+			if (track.correction_us == 0) {
+				LOG_INFO("Timestamp correction repaid, track is back on the shared timeline");
+			}
+		}
+	}
+
+	// Keep decode order strictly increasing. The correction shifts pts by the same amount, so the
+	// pts/dts distance of reordered frames is preserved.
+	if (track.started && dts <= track.last_dts_us) {
+		int64_t shift = track.last_dts_us + 1 - dts;
+		track.correction_us += shift;
+		track.corrections++;
+		dts += shift;
+		pts += shift;
+
+		if (track.corrections == 1 || track.corrections % 100 == 0) {
+			LOG_WARNING("Non-monotonic timestamp, shifted by %lld us (%llu corrections)", (long long)shift,
+				    (unsigned long long)track.corrections);
+		}
+	}
+
+	track.started = true;
+	track.last_dts_us = dts;
+
+	int64_t out = pts - epoch_us + base_us;
+	if (out < 0) {
+		return false;
+	}
+
+	pts_us = (uint64_t)out;
+	return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <obs-module.h>
+
+#include <cstdint>
+
+// Per-track state for MoQTimestamps.
+struct MoQTrackTimeline {
+    bool started = false;
+    int64_t last_dts_us = 0;
+    // Independent tracks only: places the track's first packet at its capture time on the shared
+    // timeline, since each encoder counts from its own start.
+    int64_t offset_us = 0;
+    // Added to this track's timestamps to keep them monotonic after the encoder jumped backwards. Paid
+    // back as the input moves on, so the track lines up with the others again.
+    int64_t correction_us = 0;
+    // Number of packets that needed a monotonic correction.
+    uint64_t corrections = 0;
+
+    void Reset()
+    {
+        *this = MoQTrackTimeline();
+    }
+};
+
+// Converts encoder timestamps to the microsecond timeline published over MoQ.
+//
+// All tracks share a single epoch, taken from the first packet of any track, so audio and video stay
+// aligned without per-track offsets. Conversion is done from each packet's absolute timestamp with an
+// exact rational multiply, so rounding never accumulates into drift.
+class MoQTimestamps
+{
+      public:
+    // Room left below the epoch for packets that start earlier than the first one, e.g. audio priming.
+    static constexpr int64_t HEADROOM_US = 1000000;
+
+    MoQTimestamps()
+        : has_epoch(false),
+          wallclock(false),
+          independent(false),
+          epoch_us(0),
+          epoch_sys_us(0),
+          base_us(0)
+    {
+    }
+
+    // Forget the epoch. With wallclock set, the timeline is anchored to Unix time (in microseconds) at
+    // the moment the first packet was captured, so subscribers can compute glass-to-glass latency.
+    // Set independent when packets come straight from the encoders rather than through OBS's
+    // interleaver, which otherwise lines up the encoders' timestamps: each track is then aligned by the
+    // capture time (sys_dts_usec) of its first packet.
+    void Reset(bool wallclock, bool independent = false);
+
+    // Returns false if the packet lands before the start of the timeline and has to be dropped.
+    bool Normalize(MoQTrackTimeline &track, const struct encoder_packet *packet, uint64_t &pts_us);
+
+    // Maps a time on OBS's monotonic clock (os_gettime_ns() / 1000, as in sys_dts_usec) to Unix time
+    // in microseconds.
+    static int64_t ToUnixMicros(int64_t sys_time_us);
+
+    // Exact floor(ts * num / den) in microseconds, for any sign of ts.
+    static int64_t ToMicros(int64_t ts, int32_t num, int32_t den);
+
+      private:
+    bool has_epoch;
+    bool wallclock;
+    bool independent;
+    int64_t epoch_us;
+    int64_t epoch_sys_us;
+    int64_t base_us;
+};
@@ -0,0 +1,243 @@
+#include "moq-uplink.h"
+
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <obs-module.h>
+#include <obs.hpp>
+
+#include "logger.h"
+#include "moq-loopback.h"
+#include "moq-relay.h"
+#include "moq-session.h"
+#include "util/platform.h"
+
+extern "C" {
+#include "moq.h"
+}
+
+namespace {
+
+constexpr uint64_t FPS = 30;
+constexpr uint64_t FRAMES_PER_STEP = MoQUplinkProbe::STEP_US * FPS / 1000000;
+// A step is saturated once less than this share of its offered rate comes back.
+constexpr uint64_t SATURATED_PERCENT = 70;
+
+// 64x64 constrained baseline SPS and its PPS, so libmoq can build the catalog.
+const uint8_t SPS[] = {0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x1e, 0xda, 0x10, 0x99};
+const uint8_t PPS[] = {0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80};
+const uint8_t IDR[] = {0x00, 0x00, 0x00, 0x01, 0x65};
+const uint8_t NON_IDR[] = {0x00, 0x00, 0x00, 0x01, 0x41};
+
+std::mutex probe_mutex;
+std::thread worker;
+std::atomic<bool> running{false};
+std::atomic<bool> stopping{false};
+
+// The subscribing side; kept for the module's lifetime so late libmoq callbacks stay valid.
+MoQLoopback receiver;
+
+std::string results_path()
+{
+	char *dir = obs_module_config_path("");
+	std::string path = std::string(dir ? dir : ".") + "/uplink-probe.json";
+	if (dir) {
+		os_mkdirs(dir);
+	}
+	bfree(dir);
+	return path;
+}
+
+void save_result(const std::string &url, uint64_t kbps)
+{
+	std::string path = results_path();
+	OBSDataAutoRelease results = obs_data_create_from_json_file_safe(path.c_str(), "bak");
+	if (!results) {
+		results = obs_data_create();
+	}
+
+	OBSDataAutoRelease result = obs_data_create();
+	obs_data_set_int(result, "kbps", (long long)kbps);
+	obs_data_set_int(result, "measured_at", (long long)time(nullptr));
+	obs_data_set_obj(results, url.c_str(), result);
+
+	if (!obs_data_save_json_safe(results, path.c_str(), "tmp", "bak")) {
+		LOG_WARNING("Failed to save the uplink measurement to %s", path.c_str());
+	}
+}
+
+// Seconds since url was last measured, or -1 if it never was.
+long long result_age(const std::string &url, uint64_t &kbps)
+{
+	std::string path = results_path();
+	OBSDataAutoRelease results = obs_data_create_from_json_file_safe(path.c_str(), "bak");
+	if (!results) {
+		return -1;
+	}
+
+	OBSDataAutoRelease result = obs_data_get_obj(results, url.c_str());
+	if (!result || obs_data_get_int(result, "kbps") <= 0) {
+		return -1;
+	}
+
+	kbps = (uint64_t)obs_data_get_int(result, "kbps");
+	return std::max((long long)time(nullptr) - obs_data_get_int(result, "measured_at"), 0LL);
+}
+
+void append_filler(std::vector<uint8_t> &frame, size_t size)
+{
+	// No zero bytes, so nothing in the filler reads as a start code.
+	if (frame.size() < size) {
+		frame.resize(size, 0xa5);
+	}
+}
+
+// Publishes at rising rates and returns the best rate that came back, in kbps (0 if nothing did).
+uint64_t measure(const std::shared_ptr<MoQSession> &publisher, int32_t track)
+{
+	uint64_t best_kbps = 0;
+	uint64_t pts_us = 0;
+	uint64_t next_ns = os_gettime_ns();
+	std::vector<uint8_t> frame;
+
+	for (uint64_t kbps = MoQUplinkProbe::START_KBPS; kbps <= MoQUplinkProbe::MAX_KBPS && !stopping;
+	     kbps = kbps * 3 / 2) {
+		size_t frame_size = std::max<size_t>((size_t)(kbps * 1000 / 8 / FPS), 64);
+		uint64_t received_before = receiver.Bytes();
+		uint64_t step_start_ns = os_gettime_ns();
+
+		for (uint64_t i = 0; i < FRAMES_PER_STEP && !stopping && publisher->Usable(); i++) {
+			// Each step starts a group, so a subscriber that fell behind can skip ahead.
+			frame.clear();
+			if (i == 0) {
+				frame.insert(frame.end(), SPS, SPS + sizeof(SPS));
+				frame.insert(frame.end(), PPS, PPS + sizeof(PPS));
+				frame.insert(frame.end(), IDR, IDR + sizeof(IDR));
+			} else {
+				frame.insert(frame.end(), NON_IDR, NON_IDR + sizeof(NON_IDR));
+			}
+			append_filler(frame, frame_size);
+
+			moq_publish_media_frame(track, frame.data(), frame.size(), pts_us);
+			pts_us += 1000000 / FPS;
+			next_ns += 1000000000 / FPS;
+			os_sleepto_ns(next_ns);
+		}
+
+		uint64_t elapsed_us = (os_gettime_ns() - step_start_ns) / 1000;
+		uint64_t received = receiver.Bytes() - received_before;
+		uint64_t received_kbps = elapsed_us ? received * 8 * 1000 / elapsed_us : 0;
+		best_kbps = std::max(best_kbps, received_kbps);
+
+		LOG_DEBUG("Uplink probe: offered %llu kbps, received %llu kbps", (unsigned long long)kbps,
+			  (unsigned long long)received_kbps);
+
+		// The first steps also cover the subscription setup, so only judge steps that follow a delivery.
+		if (received_before > 0 && received_kbps * 100 < kbps * SATURATED_PERCENT) {
+			break;
+		}
+	}
+
+	return best_kbps;
+}
+
+void run(std::vector<std::string> candidates, std::string path, uint64_t max_age_us)
+{
+	std::string url = candidates.front();
+	if (candidates.size() > 1) {
+		url = MoQRelaySelector::Select(candidates, MoQRelaySelector::PROBE_TIMEOUT_US);
+	}
+
+	uint64_t previous_kbps = 0;
+	long long age_sec = result_age(url, previous_kbps);
+	if (age_sec >= 0 && (uint64_t)age_sec * 1000000 < max_age_us) {
+		LOG_INFO("Uplink to %s measured %lld s ago: %llu kbps", url.c_str(), age_sec,
+			 (unsigned long long)previous_kbps);
+		running = false;
+		return;
+	}
+
+	LOG_INFO("Measuring uplink to %s", url.c_str());
+
+	auto publisher = std::make_shared<MoQSession>(url);
+	int32_t broadcast = moq_publish_create();
+	int32_t track = moq_publish_media_ordered(broadcast, "avc3", 4, nullptr, 0);
+	uint64_t kbps = 0;
+
+	if (track < 0 || !receiver.Start(url) ||
+	    moq_origin_publish(publisher->origin, path.data(), path.size(), broadcast) < 0) {
+		LOG_WARNING("Uplink probe: failed to set up the probe broadcast");
+	} else {
+		uint64_t deadline_us = os_gettime_ns() / 1000 + MoQRelaySelector::PROBE_TIMEOUT_US;
+		while (!stopping && !receiver.Failed() && publisher->Usable() &&
+		       (!receiver.Connected() || publisher->ConnectTimeSince(0) < 0) &&
+		       os_gettime_ns() / 1000 < deadline_us) {
+			os_sleep_ms(10);
+		}
+
+		if (receiver.Connected() && publisher->ConnectTimeSince(0) >= 0) {
+			if (receiver.Subscribe(path)) {
+				kbps = measure(publisher, track);
+			}
+		} else if (!stopping) {
+			LOG_WARNING("Uplink probe: could not connect to %s", url.c_str());
+		}
+	}
+
+	receiver.Stop();
+	if (track >= 0) {
+		moq_publish_media_close(track);
+	}
+	moq_publish_close(broadcast);
+	publisher.reset();
+
+	if (kbps > 0) {
+		LOG_INFO("Uplink to %s: %llu kbps", url.c_str(), (unsigned long long)kbps);
+		save_result(url, kbps);
+	} else if (!stopping) {
+		LOG_WARNING("Uplink probe: nothing came back from %s; keeping the previous measurement", url.c_str());
+	}
+
+	running = false;
+}
+
+} // namespace
+
+void MoQUplinkProbe::Start(const std::vector<std::string> &candidates, const std::string &path, uint64_t max_age_us)
+{
+	std::lock_guard<std::mutex> lock(probe_mutex);
+	if (candidates.empty() || running) {
+		return;
+	}
+
+	if (worker.joinable()) {
+		worker.join();
+	}
+
+	// The key prefix keeps the probe within what the relay lets this key publish to.
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "/uplink-probe-%08x", (unsigned)std::random_device()());
+
+	running = true;
+	stopping = false;
+	worker = std::thread(run, candidates, path + suffix, max_age_us);
+}
+
+uint64_t MoQUplinkProbe::MeasuredKbps(const std::string &url)
+{
+	uint64_t kbps = 0;
+	return result_age(url, kbps) >= 0 ? kbps : 0;
+}
+
+void MoQUplinkProbe::Shutdown()
+{
+	std::lock_guard<std::mutex> lock(probe_mutex);
+	stopping = true;
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Measures how fast the relay can take our stream before going live, so the encoders aren't started above
+// what the uplink carries.
+//
+// The probe publishes a synthetic H.264 track (valid parameter sets, filler slices) to a hidden path on
+// the relay and reads it back through a MoQLoopback. The offered rate ramps up in steps until the returned
+// rate falls behind; the best step is the measurement.
+//
+// The last measurement per relay is stored in uplink-probe.json in the plugin's config directory.
+class MoQUplinkProbe
+{
+      public:
+    // Length of each rate step.
+    static constexpr uint64_t STEP_US = 500000;
+    static constexpr uint64_t START_KBPS = 1000;
+    static constexpr uint64_t MAX_KBPS = 50000;
+
+    // Probes the relay the candidates resolve to (see MoQRelaySelector) on a background thread, unless a
+    // probe is running or that relay was measured less than max_age_us ago.
+    static void Start(const std::vector<std::string> &candidates, const std::string &path, uint64_t max_age_us);
+
+    // Last measured capacity towards url in kbps, or 0 if it was never measured.
+    static uint64_t MeasuredKbps(const std::string &url);
+
+    static void Shutdown();
+};
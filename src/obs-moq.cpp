@@ -19,8 +19,11 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <obs-module.h>
 
 #include "moq-output.h"
+#include "moq-relay.h"
 #include "moq-service.h"
+#include "moq-session.h"
 #include "moq-source.h"
+#include "moq-uplink.h"
 
 extern "C" {
 #include "moq.h"
@@ -45,3 +48,11 @@ bool obs_module_load(void)
 
 	return true;
 }
+
+void obs_module_unload(void)
+{
+	// Close a session that was kept warm for the next Start().
+	MoQSessionPool::Shutdown();
+	MoQUplinkProbe::Shutdown();
+	MoQRelaySelector::Shutdown();
+}
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Renders an obs-moq flight recorder dump as a timeline.
+
+Usage: moq-flight.py [--tail N] [--gap MS] FILE
+
+Each line shows the time relative to the first event, the event, its track, size, the time spent in
+the libmoq publish call and libmoq's result. Gaps between video objects longer than --gap milliseconds
+are marked, since they are where viewers see a freeze. A summary per track follows.
+"""
+
+import argparse
+import datetime
+import struct
+import sys
+
+MAGIC = b"MOQFLT01"
+HEADER = struct.Struct("<8sIIQq")
+EVENT = struct.Struct("<QQIIiBBBB")
+
+TYPES = {
+    1: "start",
+    2: "object",
+    3: "expired",
+    4: "connected",
+    5: "session-closed",
+    6: "track-roll",
+    7: "encoder-error",
+    8: "stop",
+    9: "migrated",
+}
+
+
+def track_name(track):
+    return "video" if track == 0 else "audio%d" % (track - 1)
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    magic, event_size, _, count, unix_offset_us = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        sys.exit("%s: not a flight recorder dump" % path)
+
+    events = []
+    offset = HEADER.size
+    for _ in range(count):
+        events.append(EVENT.unpack_from(data, offset))
+        offset += event_size
+
+    return unix_offset_us, events
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Render an obs-moq flight recorder dump.")
+    parser.add_argument("file")
+    parser.add_argument("--tail", type=int, default=0, help="only show the last N events")
+    parser.add_argument("--gap", type=float, default=200.0, help="mark video gaps longer than this (ms)")
+    args = parser.parse_args()
+
+    unix_offset_us, events = load(args.file)
+    if not events:
+        print("No events recorded.")
+        return
+
+    start_us = events[0][1]
+    wall = datetime.datetime.fromtimestamp((start_us + unix_offset_us) / 1e6)
+    print("%d events from %s" % (len(events), wall.isoformat(sep=" ", timespec="milliseconds")))
+    print()
+    print("%12s  %-15s %-7s %10s  %-3s %10s  %s" % ("t (ms)", "event", "track", "bytes", "key", "call (us)", "result"))
+
+    stats = {}
+    last_video_us = None
+    first_shown = len(events) - args.tail if args.tail > 0 else 0
+
+    for i, (_, time_us, duration_ns, size, result, kind, track, keyframe, _) in enumerate(events):
+        name = TYPES.get(kind, "type%d" % kind)
+        is_object = kind in (2, 3)
+
+        if is_object:
+            s = stats.setdefault(track, {"objects": 0, "bytes": 0, "refused": 0, "expired": 0, "max_call_ns": 0})
+            if kind == 3:
+                s["expired"] += 1
+            elif result < 0:
+                s["refused"] += 1
+            else:
+                s["objects"] += 1
+                s["bytes"] += size
+            s["max_call_ns"] = max(s["max_call_ns"], duration_ns)
+
+        gap = None
+        if is_object and track == 0 and kind == 2:
+            if last_video_us is not None and (time_us - last_video_us) / 1000.0 > args.gap:
+                gap = (time_us - last_video_us) / 1000.0
+            last_video_us = time_us
+
+        if i < first_shown:
+            continue
+
+        if gap is not None:
+            print("%12s  --- %.1f ms without video ---" % ("", gap))
+
+        t_ms = (time_us - start_us) / 1000.0
+        if is_object:
+            print(
+                "%12.1f  %-15s %-7s %10d  %-3s %10.1f  %d"
+                % (t_ms, name, track_name(track), size, "K" if keyframe else "", duration_ns / 1000.0, result)
+            )
+        else:
+            print("%12.1f  %-15s %-7s %10s  %-3s %10s  %s" % (t_ms, name, "", "", "", "", result if result else ""))
+
+    print()
+    for track in sorted(stats):
+        s = stats[track]
+        print(
+            "%-7s %d objects (%d bytes), %d refused, %d expired, slowest publish call %.1f us"
+            % (track_name(track), s["objects"], s["bytes"], s["refused"], s["expired"], s["max_call_ns"] / 1000.0)
+        )
+
+
+if __name__ == "__main__":
+    main()